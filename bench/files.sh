@@ -0,0 +1,90 @@
+#!/bin/sh
+
+# Time converting a tree of many small files, as converting a whole
+# project does, and print the files converted per second, the best of a
+# few runs.  Lines are made up of the first fields of the rules and words
+# between them.
+
+unitex=./unitex
+rulesfile=rules.tsv
+nfiles=20000
+nlines=20
+nruns=3
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex] [-u rules-file] [-n files] [-l lines] [-r runs]
+options:
+  -x <file>         time the unitex executable (${unitex})
+  -u <file>         take the commands from the rules file (${rulesfile})
+  -n <n>            convert n (${nfiles}) files
+  -l <n>            of n (${nlines}) lines each
+  -r <n>            print the best of n (${nruns}) runs
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:u:n:l:r:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	u)
+		rulesfile="${OPTARG}"
+		;;
+	n)
+		nfiles="${OPTARG}"
+		;;
+	l)
+		nlines="${OPTARG}"
+		;;
+	r)
+		nruns="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+tree="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tree}"' EXIT
+
+grep -v '^#' "${rulesfile}" | cut -f 1 | awk -v tree="${tree}" \
+    -v nfiles="${nfiles}" -v nlines="${nlines}" '
+	{ cmd[n++] = $0 }
+	END {
+		srand(1)
+		for (i = 0; i < nfiles; ++i) {
+			dir = sprintf("%s/d%03d", tree, i % 100)
+			if (i < 100)
+				system("mkdir " dir)
+			f = sprintf("%s/f%05d.tex", dir, i)
+			for (j = 0; j < nlines; ++j) {
+				line = "word"
+				for (k = 0; k < 8; ++k)
+					line = line " " cmd[int(rand() * n)] " x_1"
+				print line > f
+			}
+			close(f)
+		}
+	}'
+
+best=''
+run=0
+while test "${run}" -lt "${nruns}" ; do
+	start="$(date +%s%N)"
+	find "${tree}" -name '*.tex' | xargs "${unitex}" -u "${rulesfile}" >/dev/null || exit 1
+	ns=$(( $(date +%s%N) - start ))
+	if test -z "${best}" || test "${ns}" -lt "${best}" ; then
+		best="${ns}"
+	fi
+	run=$(( run + 1 ))
+done
+
+echo "${nfiles} files of ${nlines} lines: $(( nfiles * 1000000000 / best )) files/s"
@@ -0,0 +1,129 @@
+#!/bin/sh
+
+# Time converting single lines of pathological nesting of growing sizes:
+# open and closed groups of subscripts and superscripts nested deep, runs
+# of them and prefixes of keys, each way.  Time should grow linearly with
+# size; a family whose time grows more than twice as fast as its size is
+# marked with a ! and makes the exit status 1.
+
+unitex=./unitex
+rulesfile=rules.tsv
+sizes='100000 400000 1600000'
+nruns=3
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex] [-u rules-file] [-n sizes] [-r runs]
+options:
+  -x <file>         time the unitex executable (${unitex})
+  -u <file>         convert with the rules file (${rulesfile})
+  -n <sizes>        make lines of about the sizes in bytes, separated by spaces (${sizes})
+  -r <n>            print the best of n (${nruns}) runs
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:u:n:r:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	u)
+		rulesfile="${OPTARG}"
+		;;
+	n)
+		sizes="${OPTARG}"
+		;;
+	r)
+		nruns="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tmp}"' EXIT
+
+# The families: name, options, head, opening unit, middle, closing unit
+# and tail, separated by |.  A line is the head, the opening unit k times,
+# the middle, the closing unit k times and the tail, k as large as fits
+# the size.
+families='nested-open||x|^{|||
+nested-alpha||x|^{\alpha|||
+unbalanced-sub|||_{\alpha\beta|||Q}
+nested-bal||x|^{|a|}|
+nested-bal-r|-r|x|^{ᵃ||}|
+open-sup-r|-r|x|^{ᵃ|||
+nested-frac||x|^\frac{||}{}|
+sup-run-r|-r|x|ᵅᵝᵞ|||
+prefix-inv|-r||⇐|||'
+
+# Write a line of about n bytes of the family read.  rep() doubles the
+# string up to k times, as appending one at a time may copy it all over
+# each time.
+genline() {
+	LC_ALL=C awk -v n="$1" '
+		function rep(s, k,    r) {
+			for (r = ""; k; k = int(k / 2)) {
+				if (k % 2)
+					r = r s
+				s = s s
+			}
+			return r
+		}
+		BEGIN {
+			k = int(n / (length(ENVIRON["open"]) + length(ENVIRON["close"])))
+			print ENVIRON["head"] rep(ENVIRON["open"], k) ENVIRON["middle"] \
+			      rep(ENVIRON["close"], k) ENVIRON["tail"]
+		}'
+}
+
+nsize=0
+printf '%-16s' 'bytes'
+for n in ${sizes} ; do
+	printf '%10s' "${n}"
+	nsize=$(( nsize + 1 ))
+	first="${first:-${n}}"
+	last="${n}"
+done
+printf '\n'
+
+printf '%s\n' "${families}" | {
+	bad=0
+	while IFS='|' read -r name opts head open middle close tail ; do
+		export head open middle close tail
+		printf '%-16s' "${name}"
+		fns=''
+		for n in ${sizes} ; do
+			genline "${n}" >"${tmp}/in.tex"
+			best=''
+			run=0
+			while test "${run}" -lt "${nruns}" ; do
+				start="$(date +%s%N)"
+				"${unitex}" ${opts} -u "${rulesfile}" "${tmp}/in.tex" >/dev/null || exit 1
+				ns=$(( $(date +%s%N) - start ))
+				if test -z "${best}" || test "${ns}" -lt "${best}" ; then
+					best="${ns}"
+				fi
+				run=$(( run + 1 ))
+			done
+			fns="${fns:-${best}}"
+			printf '%10s' "$(( best / 1000000 )).$(( best / 100000 % 10 ))"
+		done
+		# Startup keeps the smaller sizes from showing the growth in
+		# full, hence the leeway of twice the size.
+		if test "${nsize}" -gt 1 && test $(( best * first )) -gt $(( 2 * fns * last )) ; then
+			printf '  !'
+			bad=1
+		fi
+		printf '\n'
+	done
+	exit "${bad}"
+}
@@ -0,0 +1,121 @@
+#!/bin/sh
+
+# Time loading generated rules files of growing sizes, each rule a
+# control word and two CJK characters, and print the CPU time and peak
+# memory of a conversion of one line each way, which builds the tries it
+# needs.  The first characters of the second fields repeat once there are
+# more than 10000 rules.  Peak memory needs GNU time.
+
+unitex=./unitex
+sizes='1000 10000 100000 1000000'
+nruns=20
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex] [-n sizes] [-r runs]
+options:
+  -x <file>         time the unitex executable (${unitex})
+  -n <sizes>        load rules files of the sizes, separated by spaces (${sizes})
+  -r <n>            print the mean of n (${nruns}) runs
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:n:r:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	n)
+		sizes="${OPTARG}"
+		;;
+	r)
+		nruns="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tmp}"' EXIT
+
+# Write n rules to the file, the ith named \r followed by i in letters.
+genrules() {
+	LC_ALL=C awk -v n="$1" '
+		function utf8(cp) {
+			return sprintf("%c%c%c", 224 + int(cp / 4096),
+			               128 + int(cp / 64) % 64, 128 + cp % 64)
+		}
+		BEGIN {
+			for (i = 0; i < n; ++i) {
+				name = ""
+				for (k = i; ; k = int(k / 26)) {
+					name = sprintf("%c", 97 + k % 26) name
+					if (k < 26)
+						break
+				}
+				printf "\\r%s\t%s%s\n", name, utf8(19968 + i % 10000),
+				       utf8(19968 + int(i / 10000) % 10000)
+			}
+		}' >"$2"
+}
+
+# The children's CPU time in milliseconds from the second line of the
+# output of times, e.g. 0m1.230s 0m0.040s, which has to run in this shell
+# rather than in a subshell of its own.
+childms() {
+	sed -n 2p "${tmp}/times" | awk '{
+		ms = 0
+		for (f = 1; f <= 2; ++f) {
+			split($f, t, "m")
+			ms += t[1] * 60000 + t[2] * 1000
+		}
+		printf "%d\n", ms
+	}'
+}
+
+# The peak memory in KB of converting the line given with the options.
+peakkb() {
+	if test -x /usr/bin/time ; then
+		printf '%s\n' "$1" | /usr/bin/time -f %M -o "${tmp}/rss" "${unitex}" $2 \
+		    -u "${rulesfile}" >/dev/null && cat "${tmp}/rss"
+	else
+		echo -
+	fi
+}
+
+printf 'rules\tconceal ms\tconceal KB\trestore ms\trestore KB\n'
+for n in ${sizes} ; do
+	rulesfile="${tmp}/r${n}.tsv"
+	genrules "${n}" "${rulesfile}"
+	line="$(head -n 1 "${rulesfile}")"
+	tex="${line%%	*}"
+	uni="${line#*	}"
+	printf '%s' "${n}"
+	for dir in '' -r ; do
+		if test -z "${dir}" ; then
+			text="${tex}"
+		else
+			text="${uni}"
+		fi
+		times >"${tmp}/times"
+		start="$(childms)"
+		run=0
+		while test "${run}" -lt "${nruns}" ; do
+			printf '%s\n' "${text}" | "${unitex}" ${dir} -u "${rulesfile}" >/dev/null || exit 1
+			run=$(( run + 1 ))
+		done
+		times >"${tmp}/times"
+		ms=$(( $(childms) - start ))
+		printf '\t%s.%s\t%s' "$(( ms / nruns ))" "$(( ms * 10 / nruns % 10 ))" \
+		       "$(peakkb "${text}" "${dir}")"
+	done
+	printf '\n'
+done
@@ -0,0 +1,540 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+#include "phmap.h"
+
+#include "misc.h"
+#include "rules.h"
+#include "restore.h"
+#include "reference.h"
+#include "convert.h"
+#include "profile.h"
+#include "probes.h"
+
+typedef struct {
+	size_t span;
+	const char *cchar;
+} CChar;
+
+/* Match the longest rule of a class in classes from tks[i] on, nd being
+ * the node of tks[i]. */
+static size_t
+mark(Node *nd, uint64_t classes, const char *const *tks, CChar *cchars, size_t i)
+{
+	size_t j = i + 1, n = 0;
+	const char *key;
+	for (;;) {
+		if ((key = nd_key(nd, classes))) {
+			n = j - i;
+			cchars[i].cchar = key;
+		}
+		if (!nd->br || !(nd = sm_get(nd->br, tks[j])))
+			break;
+		++j;
+	}
+	cchars[i].span = n;
+	if (n && PROBING(rule__hit))
+		PROBE2(rule__hit, probetext(cchars[i].cchar), n);
+	return n;
+}
+
+/* The first token is looked up in rtroot, or if it is NULL in rtbr.  The
+ * tries are built as they are first needed.  Only rules of a class in
+ * classes are used. */
+static CChar *
+conceal(Rules *r, uint64_t classes, const char **tks, size_t ntks)
+{
+	CChar *cchars = xcalloc(ntks, sizeof(*cchars));
+	size_t i, j, n;
+	Node *nd;
+	const Strmap *ssbr;
+	char c;
+	for (i = 0; i < ntks; ) {
+		assert(i < ntks);
+		c = *tks[i];
+		if (r->test_rtbr_initial[(unsigned char)c]) {
+			if (!(r->built & RTTRIES))
+				needtries(r, RTTRIES);
+			if ((nd = (r->rtroot? ph_get(r->rtroot, tks[i]): sm_get(r->rtbr, tks[i])))
+			    && (n = mark(nd, classes, tks, cchars, i))
+			   ) {
+				i += n;
+				continue;
+			}
+			if ((c == tr('_') || c == tr('^')) && *tks[i + 1] == tr('{')) {
+				if (!(r->built & SSTRIES))
+					needtries(r, SSTRIES);
+				ssbr = (c == tr('_')? r->subsbr: r->supsbr);
+				i = j = i + 2;
+				for (;;) {
+					if ((nd = sm_get(ssbr, tks[i]))
+					    && (n = mark(nd, classes, tks, cchars, i))) {
+						i += n;
+						if (*tks[i] == tr('}')) {
+							cchars[j - 2] = (CChar){ .span = 2, .cchar = "" };
+							cchars[i++] = (CChar){ .span = 1, .cchar = "" };
+							break;
+						}
+					} else {
+						cchars[j - 2].span = 0;
+						cchars[j - 1].span = 0;
+						i = j;
+						break;
+					}
+				}
+				continue;
+			}
+		}
+
+		cchars[i].span = 0;
+		++i;
+	}
+
+	/* The braces of grouped subscripts and superscripts conceal into
+	 * nothing without a rule of their own, and aren't counted. */
+	if (r->profile) {
+		for (i = 0; i < ntks; i += (cchars[i].span? cchars[i].span: 1)) {
+			if (cchars[i].span && *cchars[i].cchar != NUL)
+				pf_hit(r->profile, PF_CONCEAL, cchars[i].cchar, cchars[i].span);
+		}
+	}
+	return cchars;
+}
+
+/* Byte length in the input of the token read at p, its blanks included. */
+static size_t
+rawtklen(const char *p)
+{
+	const char *t;
+	size_t n;
+
+	for (t = p; t[-1] != NUL; --t);
+	n = p - t;
+	if (*p == EOFBYTE)
+		return n;
+	n += strlen(p);
+	if (*p == ILSEQ)
+		--n;
+	return n;
+}
+
+/* Append the stretch (in, o, len) to map, merged with the last one where
+ * contiguous. */
+static void
+pushstretch(Idxv *map, size_t in, size_t o, size_t len)
+{
+	size_t n = iv_size(map);
+
+	if (!len)
+		return;
+	if (n && iv_get(map, n - 3) + iv_get(map, n - 1) == in
+	    && iv_get(map, n - 2) + iv_get(map, n - 1) == o) {
+		iv_set(map, n - 1, iv_get(map, n - 1) + len);
+	} else {
+		iv_push(map, in);
+		iv_push(map, o);
+		iv_push(map, len);
+	}
+}
+
+/* Record that the token at p, or only its leading blanks if blanksonly is
+ * true, was output verbatim from the offset o of the output.  If it is a
+ * token as read from the input, rather than one produced by restoration,
+ * the correspondence is appended to c->map as an (input offset, output
+ * offset, length) triple, merged with the last one where contiguous.  Raw
+ * tokens skipped over were replaced. */
+static void
+mapverbatim(Converter *c, const char *p, size_t o, bool blanksonly)
+{
+	const char *base = cv_getptr(c->cv, 0);
+	size_t pos = p - base, len;
+	const char *t;
+
+	while (c->rtk < iv_size(c->rt) && iv_get(c->rt, c->rtk) < pos)
+		c->inoff += rawtklen(base + iv_get(c->rt, c->rtk++));
+	if (c->rtk == iv_size(c->rt) || iv_get(c->rt, c->rtk) != pos)
+		return;
+
+	if (blanksonly) {
+		for (t = p; t[-1] != NUL; --t);
+		len = p - t;
+	} else {
+		++c->rtk;
+		len = rawtklen(p);
+	}
+	pushstretch(c->map, c->inoff, o, len);
+	if (!blanksonly)
+		c->inoff += len;
+}
+
+/* Put the line as read from the tokens of c->rt into c->raw, and the
+ * offsets in it where each token and its leading blanks start into
+ * c->bounds. */
+static void
+getrawline(Converter *c)
+{
+	const char *base = cv_getptr(c->cv, 0);
+	const char *p, *t;
+	size_t k, n = iv_size(c->rt);
+	const size_t *rt = iv_getptr(c->rt, 0);
+	size_t *b;
+	char *r0, *r;
+
+	cv_resize(c->raw, c->inoff);
+	iv_resize(c->bounds, 2 * n + 1);
+	r = r0 = cv_getptr(c->raw, 0);
+	b = iv_getptr(c->bounds, 0);
+	for (k = 0; k < n; ++k) {
+		p = base + rt[k];
+		for (t = p; t[-1] != NUL; --t);
+		*b++ = r - r0;
+		while (t != p)
+			*r++ = tr(*t++);
+		*b++ = r - r0;
+		if (*p == tr('\n')) {
+			*r++ = '\n';
+		} else if (*p == ILSEQ) {
+			for (t = p + 1; *t != NUL; ++t)
+				*r++ = *t;
+		} else if (*p != EOFBYTE) {
+			for (t = p; *t != NUL; ++t)
+				*r++ = tr(*t);
+		}
+	}
+	*b = r - r0;
+	assert(*b == c->inoff);
+}
+
+/* The offset in c->bounds nearest to off, not above it if down is true,
+ * else not below it. */
+static size_t
+nearbound(const Converter *c, size_t off, bool down)
+{
+	size_t lo = 0, hi = iv_size(c->bounds) - 1, mid;
+
+	if (down) {
+		while (lo < hi) {
+			mid = hi - (hi - lo) / 2;
+			if (iv_get(c->bounds, mid) <= off)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+	} else {
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (iv_get(c->bounds, mid) >= off)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+	}
+	return iv_get(c->bounds, lo);
+}
+
+/* Tokens restored and concealed back to the bytes they were read as, e.g.
+ * Unicode text in TeX, are left unchanged: make the whole tokens at the
+ * start and end of each stretch between those of c->map that the output
+ * has as they were part of the stretches either side. */
+static void
+mapunchanged(Converter *c, const Charv *out)
+{
+	const char *raw, *o = cv_getptr(out, 0);
+	const size_t *m = iv_getptr(c->map, 0);
+	size_t k, j, in = 0, on = 0, nin, non, nlen, p, s, n = iv_size(c->map);
+	bool joined = false;
+	Idxv *map;
+
+	getrawline(c);
+	raw = cv_getptr(c->raw, 0);
+	for (k = 0; k <= n; k += 3) {
+		if (k < n) {
+			nin = m[k];
+			non = m[k + 1];
+			nlen = m[k + 2];
+		} else {
+			nin = c->inoff;
+			non = cv_size(out);
+			nlen = 0;
+		}
+		for (p = 0; in + p < nin && on + p < non && raw[in + p] == o[on + p]; ++p);
+		if (p)
+			p = nearbound(c, in + p, true) - in;
+		for (s = 0; in + p + s < nin && on + p + s < non
+		            && raw[nin - s - 1] == o[non - s - 1]; ++s);
+		if (s)
+			s = nin - nearbound(c, nin - s, false);
+		/* The map is copied only once a stretch is to be joined. */
+		if ((p || s) && !joined) {
+			joined = true;
+			iv_resize(c->stretches, 0);
+			for (j = 0; j < k; ++j)
+				iv_push(c->stretches, m[j]);
+		}
+		if (joined) {
+			pushstretch(c->stretches, in, on, p);
+			pushstretch(c->stretches, nin - s, non - s, s);
+			pushstretch(c->stretches, nin, non, nlen);
+		}
+		in = nin + nlen;
+		on = non + nlen;
+	}
+	if (joined) {
+		map = c->map;
+		c->map = c->stretches;
+		c->stretches = map;
+	}
+}
+
+static void
+puttks(Converter *cvt, Charv *out, const char *const *tks, const CChar *cchars)
+{
+	const char *s, *t;
+	char c;
+	size_t i, o;
+	size_t start = PROBING(output)? cv_size(out): 0;
+
+	for (i = 0; ; ) {
+		s = tks[i];
+		o = cv_size(out);
+		if (s[-1] != NUL) {
+			for (t = s - 1; t[-1] != NUL; --t);
+			do {
+				cv_push(out, tr(*t++));
+			} while (t != s);
+		}
+		if (cchars && cchars[i].span) {
+			if (cvt->map && o != cv_size(out))
+				mapverbatim(cvt, s, o, true);
+			s = cchars[i].cchar;
+			while ((c = *s++) != NUL) {
+				do {
+					cv_push(out, tr(c));
+				} while ((c = *s++) != NUL);
+			}
+			i += cchars[i].span;
+			continue;
+		}
+		c = *s++;
+		if (c == tr('\n')) {
+			cv_push(out, '\n');
+		} else if (c == EOFBYTE) {
+			;
+		} else if (c == ILSEQ) {
+			while ((c = *s++) != NUL)
+				cv_push(out, c);
+		} else {
+			while (c != NUL) {
+				cv_push(out, tr(c));
+				c = *s++;
+			}
+		}
+		if (cvt->map)
+			mapverbatim(cvt, tks[i], o, false);
+		if (c == tr('\n') || c == EOFBYTE) {
+			PROBE1(output, cv_size(out) - start);
+			return;
+		}
+		++i;
+	}
+}
+
+void
+cvt_init(Converter *c, Rules *rules, bool reverse)
+{
+	c->rules = rules;
+	c->reverse = reverse;
+	c->cv = cv_new();
+	c->iv = iv_new();
+	c->ib = iv_new();
+	c->rt = NULL;
+	c->map = NULL;
+	c->reference = false;
+	c->classes = ALLCLASSES;
+	c->timed = false;
+}
+
+void
+cvt_usereference(Converter *c)
+{
+	c->reference = true;
+}
+
+void
+cvt_useclasses(Converter *c, uint64_t classes)
+{
+	c->classes = classes;
+}
+
+void
+cvt_time(Converter *c)
+{
+	c->timed = true;
+}
+
+void
+cvt_measureinput(Converter *c)
+{
+	if (!c->rt)
+		c->rt = iv_new();
+}
+
+void
+cvt_trackpositions(Converter *c)
+{
+	if (!c->map) {
+		cvt_measureinput(c);
+		c->map = iv_new();
+		c->stretches = iv_new();
+		c->raw = cv_new();
+		c->bounds = iv_new();
+	}
+}
+
+void
+cvt_uninit(Converter *c)
+{
+	cv_delete(c->cv);
+	iv_delete(c->iv);
+	iv_delete(c->ib);
+	if (c->rt)
+		iv_delete(c->rt);
+	if (c->map) {
+		iv_delete(c->map);
+		iv_delete(c->stretches);
+		cv_delete(c->raw);
+		iv_delete(c->bounds);
+	}
+}
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The nanoseconds since *t, which is advanced to now. */
+static uint64_t
+lap(uint64_t *t)
+{
+	uint64_t now = nsnow(), d = now - *t;
+
+	*t = now;
+	return d;
+}
+
+void
+convertline(Converter *c, FILE *f, Charv *out)
+{
+	Rules *r = c->rules;
+	bool doconceal;
+	const char **tks;
+	size_t ntks, j;
+	CChar *cchars;
+	uint64_t t = 0;
+
+	if (c->reference) {
+		refconvertline(r, c->reverse, c->classes, c->cv, c->iv, c->ib, f, out);
+		return;
+	}
+
+	PROBE1(line__start, c->reverse);
+	c->inoff = 0;
+	if (c->reverse) {
+		doconceal = false;
+	} else {
+		char ch = getc(f);
+		if (ch == '\x03') {
+			doconceal = false;
+		} else {
+			ungetc(ch, f);
+			doconceal = true;
+		}
+	}
+
+	if (c->rt) {
+		iv_resize(c->rt, 0);
+		c->rtk = 0;
+	}
+	if (c->map)
+		iv_resize(c->map, 0);
+
+	if (c->timed) {
+		t = nsnow();
+		c->ns[1] = c->ns[2] = 0;
+		c->ntks = 0;
+	}
+	c->depth = getrestoredline(r, c->classes, c->cv, c->iv, c->ib, c->rt, f);
+	if (c->timed)
+		c->ns[0] = lap(&t);
+	if (ferror(f))
+		goto out;
+
+	assert(cv_get(c->cv, iv_top(c->iv)) == tr('\n') || cv_get(c->cv, iv_top(c->iv)) == EOFBYTE);
+
+	ntks = iv_size(c->iv);
+	tks = xcalloc(ntks, sizeof(*tks));
+	for (j = ntks; j--; )
+		tks[j] = cv_getptr(c->cv, iv_get(c->iv, j));
+
+	if (doconceal)
+		cchars = conceal(r, c->classes, (const char**)tks, ntks);
+	else
+		cchars = NULL;
+	if (c->timed)
+		c->ns[1] = lap(&t);
+
+	puttks(c, out, tks, cchars);
+	if (c->timed) {
+		c->ns[2] = lap(&t);
+		c->ntks = ntks;
+	}
+
+	if (c->rt) {
+		const char *base = cv_getptr(c->cv, 0);
+
+		while (c->rtk < iv_size(c->rt))
+			c->inoff += rawtklen(base + iv_get(c->rt, c->rtk++));
+	}
+
+	if (c->map) {
+		size_t n;
+
+		/* Restoration of subscripts and superscripts may move the
+		 * newline, but it always ends both lines. */
+		n = iv_size(c->map);
+		if (cv_size(out) && cv_top(out) == '\n'
+		    && (!n || iv_get(c->map, n - 2) + iv_get(c->map, n - 1) != cv_size(out))) {
+			iv_push(c->map, c->inoff - 1);
+			iv_push(c->map, cv_size(out) - 1);
+			iv_push(c->map, 1);
+		}
+		mapunchanged(c, out);
+	}
+
+	free(cchars);
+	free(tks);
+
+out:
+	cv_resize(c->cv, 0);
+	iv_resize(c->iv, 0);
+	PROBE1(line__done, c->reverse);
+}
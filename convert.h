@@ -0,0 +1,59 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" should be included before this header */
+
+/* A converter converts lines with rules, from TeX to Unicode unless
+ * reverse, using only the rules of a class in classes, by default all.
+ * cv, iv and ib are the buffers of getrestoredline(), cv and iv being
+ * empty between lines.  If reference is set, it converts with
+ * refconvertline() instead, which neither tracks positions nor times.
+ *
+ * If the input is measured, rt isn't NULL: it holds the index of each
+ * token read from the line, rtk the first of them not yet walked past and
+ * inoff the input offset it is at, and after each convertline() inoff is
+ * the length of the input line.  Tracking positions measures the input
+ * too, and map isn't NULL: after each convertline() it holds the line's
+ * correspondence of input to output as (input offset, output offset,
+ * length) triples of byte offsets, each for a stretch of the input output
+ * unchanged; bytes between the stretches were replaced.  Input offsets
+ * don't count a leading \x03 marker.  stretches, raw and bounds are for
+ * joining the stretches across tokens output as they were read.
+ *
+ * If timed is set, after each convertline() ns holds the nanoseconds taken
+ * to restore the tokens of the line, to conceal them and to put them out,
+ * ntks the number of tokens and depth the most tokens looked ahead at
+ * once. */
+typedef struct {
+	Rules *rules;
+	bool reverse;
+	bool reference;
+	uint64_t classes;
+	Charv *cv;
+	Idxv *iv;
+	Idxv *ib;
+	Idxv *rt;
+	Idxv *map;
+	Idxv *stretches;
+	Charv *raw;
+	Idxv *bounds;
+	size_t rtk;
+	size_t inoff;
+	bool timed;
+	uint64_t ns[3];
+	size_t ntks;
+	size_t depth;
+} Converter;
+
+void cvt_init(Converter *c, Rules *rules, bool reverse);
+void cvt_uninit(Converter *c);
+void cvt_measureinput(Converter *c);
+void cvt_trackpositions(Converter *c);
+void cvt_usereference(Converter *c);
+void cvt_useclasses(Converter *c, uint64_t classes);
+void cvt_time(Converter *c);
+void convertline(Converter *c, FILE *f, Charv *out);
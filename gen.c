@@ -0,0 +1,627 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+
+#include "misc.h"
+#include "rules.h"
+#include "profile.h"
+#include "gen.h"
+
+typedef struct {
+	char *from;
+	char *to;
+	size_t fromlen;
+	const char *order;
+} Genrule;
+
+/* State of collect(), which sm_foreach() gives no way to pass. */
+static struct {
+	Charv *path;
+	Genrule *rules;
+	size_t n, cap;
+} gs;
+
+static char *
+xstrdup(const char *s)
+{
+	return strcpy(xmalloc(strlen(s) + 1), s);
+}
+
+/* Number of characters in a UTF-8 string. */
+static size_t
+utf8len(const char *s)
+{
+	size_t n = 0;
+	for (; *s; ++s) {
+		if ((*s & 0xc0) != 0x80)
+			++n;
+	}
+	return n;
+}
+
+/* Decode the tokens starting at p, up to an empty one, into text. */
+static char *
+keytext(const char *p)
+{
+	Charv *cv = cv_new();
+	char c;
+
+	do {
+		while ((c = *p++) != NUL)
+			cv_push(cv, tr(c));
+	} while (*p != NUL);
+	cv_push(cv, NUL);
+	return cv_to_block(cv);
+}
+
+static void
+collect(const char *key, void *value)
+{
+	const Node *nd = value;
+	size_t len = cv_size(gs.path);
+	const char *t;
+	Genrule *r;
+
+	for (t = key; t[-1] != NUL; --t);
+	while (t != key)
+		cv_push(gs.path, tr(*t++));
+	while (*t != NUL)
+		cv_push(gs.path, tr(*t++));
+
+	if (nd->key) {
+		if (gs.n == gs.cap) {
+			gs.cap = gs.cap + gs.cap / 2 + 16;
+			gs.rules = xreallocarray(gs.rules, gs.cap, sizeof(*gs.rules));
+		}
+		r = gs.rules + gs.n++;
+		cv_push(gs.path, NUL);
+		r->from = xstrdup(cv_getptr(gs.path, 0));
+		cv_pop(gs.path);
+		r->to = keytext(nd->key);
+		r->fromlen = utf8len(r->from);
+		r->order = nd->key;
+	}
+	if (nd->br)
+		sm_foreach(nd->br, collect);
+
+	cv_resize(gs.path, len);
+}
+
+/* Most characters to substitute first, of equal ones the rule read last. */
+static int
+cmprules(const void *a, const void *b)
+{
+	const Genrule *r1 = a, *r2 = b;
+
+	if (r1->fromlen != r2->fromlen)
+		return r1->fromlen < r2->fromlen? 1: -1;
+	return (r1->order < r2->order) - (r1->order > r2->order);
+}
+
+static int
+cmpfrom(const void *a, const void *b)
+{
+	return strcmp(((const Genrule *)a)->from, ((const Genrule *)b)->from);
+}
+
+/* Collect the rules in a trie, the substituend of each being the path. */
+static void
+collectrules(Strmap *br)
+{
+	gs.path = cv_new();
+	gs.rules = NULL;
+	gs.n = gs.cap = 0;
+	sm_foreach(br, collect);
+	cv_delete(gs.path);
+}
+
+static void
+freecollected(void)
+{
+	while (gs.n--) {
+		free(gs.rules[gs.n].from);
+		free(gs.rules[gs.n].to);
+	}
+	free(gs.rules);
+}
+
+void
+genstyle(const Rules *rules, FILE *f)
+{
+	size_t i;
+	const char *s;
+
+	fputs("\\makeatletter\n"
+	      "\n"
+	      "% This part is based on the newunicodechar LaTeX package\n"
+	      "\\begingroup\n"
+	      "\\edef\\ext{\\@gobble^^^^0021}\n"
+	      "\\expandafter\\endgroup\n"
+	      "\\ifx\\ext\\@empty\n"
+	      "\t\\chardef\\unitex@atcode=\\catcode`\\~\n"
+	      "\t\\catcode`\\~=\\active\n"
+	      "\t\\def\\unitex@nuc#1#2{\n"
+	      "\t\t\\catcode`#1=\\active\n"
+	      "\t\t\\begingroup\\lccode`\\~=`#1\n"
+	      "\t\t\\lowercase{\\endgroup\\protected\\def~}{#2}\n"
+	      "\t}\n"
+	      "\t\\catcode`\\~=\\unitex@atcode\n"
+	      "\\else\n"
+	      "\t\\RequirePackage[utf8]{inputenc}\n"
+	      "\t\\def\\unitex@nuc#1#2{\n"
+	      "\t\t\\edef\\unitex@temp{\\detokenize{#1}}\n"
+	      "\t\t\\@namedef{u8:\\unitex@temp}{#2}\n"
+	      "\t}\n"
+	      "\\fi\n"
+	      "\n", f);
+
+	/* Only single characters can be made active. */
+	collectrules(rules->invbr);
+	qsort(gs.rules, gs.n, sizeof(*gs.rules), cmpfrom);
+	for (i = 0; i < gs.n; ++i) {
+		s = gs.rules[i].from;
+		if (gs.rules[i].fromlen == 1 && (unsigned char)*s >= 0x80)
+			fprintf(f, "\\unitex@nuc{%s}{%s}\n", s, gs.rules[i].to);
+	}
+	freecollected();
+
+	fputs("\n"
+	      "\\makeatother\n", f);
+}
+
+/* Append s to cv, escaping the characters in special for sed. */
+static void
+sedesc(Charv *cv, const char *s, const char *special)
+{
+	for (; *s; ++s) {
+		if (strchr(special, *s))
+			cv_push(cv, '\\');
+		cv_push(cv, *s);
+	}
+}
+
+#define PAT "\\(\\\\\\([[:alpha:]]\\+\\|[^[:alpha:]]\\)\\({[^{}]*}\\)*\\|[^\\{}]\\)"
+#define PATB "\\(" PAT "[[:blank:]]*\\)"
+
+static void
+genmerge(FILE *f, const char *label, const char *l)
+{
+	fprintf(f, ":%s\n", label);
+	fprintf(f, "s/\\([^\\]\\)%s" PATB "%s" PAT "/\\1%s{\\2\\6}/g\n", l, l, l);
+	fprintf(f, "s/\\([^\\]\\)%s" PATB "%s{\\(" PATB "\\+\\)}/\\1%s{\\2\\6}/g\n", l, l, l);
+	fprintf(f, "s/\\([^\\]\\)%s{\\(" PATB "\\+\\)}\\([[:blank:]]*\\)%s" PAT "/\\1%s{\\2\\7\\8}/g\n", l, l, l);
+	fprintf(f, "s/\\([^\\]\\)%s{\\(" PATB "\\+\\)}\\([[:blank:]]*\\)%s{\\(" PATB "\\+\\)}/\\1%s{\\2\\7\\8}/g\n", l, l, l);
+	fprintf(f, "t %s\n", label);
+}
+
+void
+gensed(const Rules *rules, bool reverse, FILE *f)
+{
+	Charv *cv = cv_new();
+	Genrule *r;
+	size_t i, j;
+	const char *s;
+
+	collectrules(rules->invbr);
+	qsort(gs.rules, gs.n, sizeof(*gs.rules), cmprules);
+	for (i = 0; i < gs.n; ++i) {
+		r = gs.rules + i;
+		cv_resize(cv, 0);
+		sedesc(cv, r->from, "[]*.$^\\/&");
+		cv_push(cv, '/');
+		sedesc(cv, r->to, "[]*.$^\\/&");
+		cv_push(cv, NUL);
+		fprintf(f, "s/%s/g\n", cv_getptr(cv, 0));
+	}
+	freecollected();
+
+	genmerge(f, "MERGESUBS", "_");
+	genmerge(f, "MERGESUPS", "\\^");
+
+	if (!reverse) {
+		/* Control words in the text are delimited by \x1f while the
+		 * script runs, so that e.g. \in doesn't match in \int. */
+		fputs("s/\\\\[[:alpha:]]\\+/&\x1f/g\n", f);
+
+		collectrules(rules->rtbr);
+		qsort(gs.rules, gs.n, sizeof(*gs.rules), cmprules);
+		for (i = 0; i < gs.n; ++i) {
+			r = gs.rules + i;
+			cv_resize(cv, 0);
+			for (s = r->from; *s; ) {
+				cv_push(cv, *s);
+				if (*s++ == '\\' && isalpha((unsigned char)*s)) {
+					do cv_push(cv, *s++); while (isalpha((unsigned char)*s));
+					cv_push(cv, '\x1f');
+				}
+			}
+			cv_push(cv, NUL);
+			/* A grouped subscript or superscript as a whole is
+			 * matched without the braces. */
+			s = cv_getptr(cv, 0);
+			j = strlen(s);
+			if ((*s == '_' || *s == '^') && s[1] == '{' && s[j - 1] == '}'
+			    && j > 3 && !strpbrk(s + 2, "{") && strchr(s + 2, '}') == s + j - 1) {
+				memmove(cv_getptr(cv, 1), cv_getptr(cv, 2), j - 3);
+				cv_resize(cv, j - 2);
+				cv_push(cv, NUL);
+			}
+			free(r->from);
+			r->from = xstrdup(cv_getptr(cv, 0));
+
+			cv_resize(cv, 0);
+			sedesc(cv, r->from, "[]*.$^\\/");
+			cv_push(cv, '/');
+			sedesc(cv, r->to, "[]*.$^\\/");
+			cv_push(cv, NUL);
+			free(r->to);
+			r->to = xstrdup(cv_getptr(cv, 0));
+		}
+
+		for (j = 0; j < 2; ++j) {
+			const char *label = j? "BREAKSUPS": "BREAKSUBS";
+			const char *l = j? "\\^": "_";
+			size_t ll = strlen(l);
+			bool first = true;
+
+			cv_resize(cv, 0);
+			for (i = 0; i < gs.n; ++i) {
+				s = gs.rules[i].to;
+				if (strncmp(s, l, ll) || s[ll] == '/')
+					continue;
+				if (!first) {
+					cv_push(cv, '\\');
+					cv_push(cv, '|');
+				}
+				first = false;
+				for (s += ll; *s != '/'; ++s) {
+					if (*s == '\\')
+						cv_push(cv, *s++);
+					cv_push(cv, *s);
+				}
+			}
+			cv_push(cv, NUL);
+			s = cv_getptr(cv, 0);
+			fprintf(f, ":%s\n", label);
+			fprintf(f, "s/\\([^\\]\\)%s{\\(\\(%s\\)[[:blank:]]*\\)\\(\\(\\(%s\\)[[:blank:]]*\\)\\+\\)}/\\1%s\\2%s{\\4}/g\n",
+			        l, s, s, l, l);
+			fprintf(f, "t %s\n", label);
+			fprintf(f, "s/\\([^\\]\\)%s{\\(\\(%s\\)[[:blank:]]*\\)}/\\1%s\\2/g\n", l, s, l);
+		}
+
+		for (i = 0; i < gs.n; ++i)
+			fprintf(f, "s/%s/g\n", gs.rules[i].to);
+		freecollected();
+
+		fputs("s/\x1f//g\n", f);
+	}
+
+	cv_delete(cv);
+}
+
+/* Where a map or a node of the tries goes in its array, and for a map
+ * where its cells start and how many it has, its chains included.  Maps
+ * and nodes are numbered in the order the tries are walked. */
+typedef struct {
+	unsigned long heat;
+	size_t index;
+	size_t cellbase;
+	size_t ncells;
+} Place;
+
+/* State of survey*(), emitmap() and emitnode(), which lay out and write
+ * the initializers of the arrays of maps, nodes, cells and alts of the
+ * tries, walking them in the same order.  Heat is the hits that a profile
+ * pf counts of the rules of a node and those below it.  The alts of a node
+ * are written in a row in their order as they are come to. */
+static struct {
+	FILE *nodes, *maps, *cells, *alts;
+	size_t nnodes, nmaps, ncells, nalts;
+	const Rules *rules;
+	const Profile *pf;
+	Place *nodeplaces, *mapplaces;
+	size_t nodecap, mapcap;
+} cs;
+
+static size_t emitmap(const Strmap *sm);
+
+static size_t
+addplace(Place **places, size_t *cap, size_t *n)
+{
+	if (*n == *cap)
+		*places = xreallocarray(*places, *cap = *cap * 2 + 16, sizeof(**places));
+	(*places)[*n].heat = 0;
+	(*places)[*n].ncells = 0;
+	return (*n)++;
+}
+
+static unsigned long surveymap(const Strmap *sm, int dir);
+
+static unsigned long
+surveynode(const Node *nd, int dir)
+{
+	size_t i = addplace(&cs.nodeplaces, &cs.nodecap, &cs.nnodes);
+	unsigned long heat = 0;
+
+	if (nd->key && cs.pf)
+		heat = pf_hits(cs.pf, dir, nd->key);
+	if (nd->br)
+		heat += surveymap(nd->br, dir);
+	cs.nodeplaces[i].heat = heat;
+	return heat;
+}
+
+static unsigned long
+surveymap(const Strmap *sm, int dir)
+{
+	size_t i = addplace(&cs.mapplaces, &cs.mapcap, &cs.nmaps), k, n = sm->len;
+	const struct StrmapCell *cell;
+	unsigned long heat = 0;
+
+	for (k = 0; k < sm->len; ++k) {
+		for (cell = sm->cellarr + k; cell && cell->key; cell = cell->next) {
+			if (cell != sm->cellarr + k)
+				++n;
+			heat += surveynode(cell->value, dir);
+		}
+	}
+	cs.mapplaces[i].heat = heat;
+	cs.mapplaces[i].ncells = n;
+	return heat;
+}
+
+static const Place *byheat_places;
+
+static int
+byheat(const void *a, const void *b)
+{
+	const Place *x = &byheat_places[*(const size_t *)a];
+	const Place *y = &byheat_places[*(const size_t *)b];
+
+	if (x->heat != y->heat)
+		return (x->heat < y->heat) - (x->heat > y->heat);
+	return (*(const size_t *)a > *(const size_t *)b) - (*(const size_t *)a < *(const size_t *)b);
+}
+
+/* Index the places hottest first, the cells of maps following their
+ * order, and return the number of cells. */
+static size_t
+rank(Place *places, size_t n)
+{
+	size_t *order = xcalloc(n + 1, sizeof(*order));
+	size_t k, ncells = 0;
+
+	for (k = 0; k < n; ++k)
+		order[k] = k;
+	byheat_places = places;
+	qsort(order, n, sizeof(*order), byheat);
+	for (k = 0; k < n; ++k) {
+		places[order[k]].index = k;
+		places[order[k]].cellbase = ncells;
+		ncells += places[order[k]].ncells;
+	}
+	free(order);
+	return ncells;
+}
+
+/* The offset of p in the data written, which for rules laid over a base
+ * is that of the base followed by their own. */
+static size_t
+dataoff(const char *p)
+{
+	const Rules *base = cs.rules->base;
+
+	if (base && indata(base, p))
+		return p - base->data;
+	assert(indata(cs.rules, p));
+	return (base? base->datalen: 0) + (p - cs.rules->data);
+}
+
+static size_t
+emitnode(const Node *nd)
+{
+	size_t i = cs.nodeplaces[cs.nnodes++].index, br;
+	const Alt *alt;
+
+	/* The branch is written first, not to interrupt this line. */
+	if (nd->br) {
+		br = emitmap(nd->br);
+		fprintf(cs.nodes, "\t[%zu] = { (Strmap *)&maps[%zu], ", i, br);
+	} else {
+		fprintf(cs.nodes, "\t[%zu] = { NULL, ", i);
+	}
+	if (nd->key)
+		fprintf(cs.nodes, "data + %zu, %#llx, ", dataoff(nd->key),
+		        (unsigned long long)nd->classes);
+	else
+		fputs("NULL, 0, ", cs.nodes);
+	if (nd->alts)
+		fprintf(cs.nodes, "(Alt *)&alts[%zu] },\n", cs.nalts);
+	else
+		fputs("NULL },\n", cs.nodes);
+	for (alt = nd->alts; alt; alt = alt->next) {
+		fprintf(cs.alts, "\t[%zu] = { data + %zu, %#llx, ", cs.nalts, dataoff(alt->key),
+		        (unsigned long long)alt->classes);
+		++cs.nalts;
+		if (alt->next)
+			fprintf(cs.alts, "(Alt *)&alts[%zu] },\n", cs.nalts);
+		else
+			fputs("NULL },\n", cs.alts);
+	}
+	return i;
+}
+
+static size_t
+emitmap(const Strmap *sm)
+{
+	const Place *pl = &cs.mapplaces[cs.nmaps++];
+	size_t i = pl->index, base = pl->cellbase, chained = base + sm->len, k, next, n;
+	const struct StrmapCell *cell;
+
+	for (k = 0; k < sm->len; ++k) {
+		n = base + k;
+		for (cell = sm->cellarr + k; cell && cell->key; cell = cell->next) {
+			next = (cell->next? chained++: 0);
+			fprintf(cs.cells, "\t[%zu] = { data + %zu, (void *)&nodes[%zu], ",
+			        n, dataoff(cell->key), emitnode(cell->value));
+			if (next)
+				fprintf(cs.cells, "(struct StrmapCell *)&cells[%zu] },\n", next);
+			else
+				fputs("NULL },\n", cs.cells);
+			n = next;
+		}
+	}
+	fprintf(cs.maps, "\t[%zu] = { (struct StrmapCell *)&cells[%zu], %zu, %zu, %zu },\n",
+	        i, base, sm->len, sm->payload, sm->maxpayload);
+	return i;
+}
+
+static void
+emitbytes(FILE *f, const char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		fprintf(f, "%s'\\x%02x',", i % 12? " ": "\n\t", (unsigned char)p[i]);
+	fputs("\n", f);
+}
+
+static void
+emitarray(FILE *f, const char *decl, char *body)
+{
+	fprintf(f, "\n%s = {\n%s};\n", decl, body);
+	free(body);
+}
+
+void
+gencsource(const Rules *rules, const struct Profile *pf, const Strv *files, FILE *f)
+{
+	Charv *text = cv_new();
+	char *nodes, *maps, *cells, *alts;
+	size_t nodeslen, mapslen, cellslen, altslen, i;
+	size_t invbr, rtbr, subsbr, supsbr;
+	FILE *in;
+	int c;
+
+	for (i = 0; i < sv_size(files); ++i) {
+		const char *fname = sv_get(files, i);
+		size_t start = cv_size(text);
+
+		if (!(in = openrules(fname)))
+			error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+		for (c = getc(in); c != EOF; c = getc(in))
+			cv_push(text, c);
+		/* The files are joined, where a byte order mark is only
+		 * skipped at the start. */
+		if (start && cv_size(text) - start >= 3
+		    && !memcmp(cv_getptr(text, start), "\xef\xbb\xbf", 3))
+			cv_erasen(text, start, 3);
+		if (cv_size(text) && cv_top(text) != '\n')
+			cv_push(text, '\n');
+		if (ferror(in))
+			error(EXIT_FAILURE, 0, "input error during reading %s", fname);
+		fclose(in);
+	}
+	if (!cv_size(text))
+		error(EXIT_FAILURE, 0, "no rules to build in");
+
+	cs.rules = rules;
+	cs.pf = pf;
+	cs.nodeplaces = cs.mapplaces = NULL;
+	cs.nnodes = cs.nmaps = cs.nodecap = cs.mapcap = 0;
+	surveymap(rules->invbr, PF_RESTORE);
+	surveymap(rules->rtbr, PF_CONCEAL);
+	surveymap(rules->subsbr, PF_CONCEAL);
+	surveymap(rules->supsbr, PF_CONCEAL);
+	rank(cs.nodeplaces, cs.nnodes);
+	cs.ncells = rank(cs.mapplaces, cs.nmaps);
+
+	cs.nnodes = cs.nmaps = cs.nalts = 0;
+	if (!(cs.nodes = open_memstream(&nodes, &nodeslen))
+	    || !(cs.maps = open_memstream(&maps, &mapslen))
+	    || !(cs.cells = open_memstream(&cells, &cellslen))
+	    || !(cs.alts = open_memstream(&alts, &altslen)))
+		error(EXIT_FAILURE, errno, "open_memstream");
+	invbr = emitmap(rules->invbr);
+	rtbr = emitmap(rules->rtbr);
+	subsbr = emitmap(rules->subsbr);
+	supsbr = emitmap(rules->supsbr);
+	if (fclose(cs.nodes) || fclose(cs.maps) || fclose(cs.cells) || fclose(cs.alts))
+		error(EXIT_FAILURE, errno, "open_memstream");
+	free(cs.nodeplaces);
+	free(cs.mapplaces);
+
+	fputs("/* Generated by unitex -C, do not edit. */\n"
+	      "\n"
+	      "#include <stdbool.h>\n"
+	      "#include <stdint.h>\n"
+	      "#include <stdio.h>\n"
+	      "\n"
+	      "#include \"strmap.h\"\n"
+	      "#include \"vec.h\"\n"
+	      "\n"
+	      "#include \"misc.h\"\n"
+	      "#include \"rules.h\"\n"
+	      "\n", f);
+	fprintf(f, "static const Node nodes[%zu];\n", cs.nnodes);
+	fprintf(f, "static const Strmap maps[%zu];\n", cs.nmaps);
+	fprintf(f, "static const struct StrmapCell cells[%zu];\n", cs.ncells);
+	if (cs.nalts)
+		fprintf(f, "static const Alt alts[%zu];\n", cs.nalts);
+
+	fprintf(f, "\nstatic const char data[%zu] = {",
+	        (rules->base? rules->base->datalen: 0) + rules->datalen);
+	if (rules->base)
+		emitbytes(f, rules->base->data, rules->base->datalen);
+	emitbytes(f, rules->data, rules->datalen);
+	fputs("};\n", f);
+
+	emitarray(f, "static const Node nodes[]", nodes);
+	emitarray(f, "static const Strmap maps[]", maps);
+	emitarray(f, "static const struct StrmapCell cells[]", cells);
+	if (cs.nalts)
+		emitarray(f, "static const Alt alts[]", alts);
+	else
+		free(alts);
+
+	fprintf(f, "\nconst Rules builtin_rules = {\n"
+	           "\t.invbr = (Strmap *)&maps[%zu],\n"
+	           "\t.rtbr = (Strmap *)&maps[%zu],\n"
+	           "\t.subsbr = (Strmap *)&maps[%zu],\n"
+	           "\t.supsbr = (Strmap *)&maps[%zu],\n"
+	           "\t.test_rtbr_initial = { false,",
+	        invbr, rtbr, subsbr, supsbr);
+	for (i = 0; i < 256; ++i) {
+		if (rules->test_rtbr_initial[i])
+			fprintf(f, " [%zu] = true,", i);
+	}
+	fprintf(f, " },\n"
+	           "\t.data = (char *)data,\n"
+	           "\t.datalen = sizeof(data),\n"
+	           "\t.nrules = %zu,\n"
+	           "\t.isstatic = true,\n"
+	           "};\n", rules->nrules);
+
+	fprintf(f, "\nconst char builtin_rules_text[%zu] = {", cv_size(text));
+	emitbytes(f, cv_getptr(text, 0), cv_size(text));
+	fputs("};\n", f);
+	fputs("\nconst size_t builtin_rules_textlen = sizeof(builtin_rules_text);\n", f);
+
+	cv_delete(text);
+}
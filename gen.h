@@ -0,0 +1,24 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" should be included before this header */
+
+/* Write a LaTeX style file that makes each character of the rules
+ * typeset as its TeX substituend. */
+void genstyle(const Rules *rules, FILE *f);
+
+/* Write a sed script that converts in reverse, and unless reverse is
+ * true also forward.  The rules must have been parsed for forward
+ * conversion. */
+void gensed(const Rules *rules, bool reverse, FILE *f);
+
+/* Write C source defining builtin_rules and builtin_rules_text, from the
+ * rules parsed for forward conversion, without filters, from files.  The
+ * maps, nodes and cells of the tries are laid out in their arrays with
+ * those the profile pf counts most hits through first, so that they share
+ * cache lines and pages; pf may be NULL. */
+void gencsource(const Rules *rules, const struct Profile *pf, const Strv *files, FILE *f);
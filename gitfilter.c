@@ -0,0 +1,220 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+
+#include "rules.h"
+#include "convert.h"
+#include "metrics.h"
+#include "gitfilter.h"
+
+/* See gitprotocol-common(5) and the "Long Running Filter Process" section
+ * of gitattributes(5) for the protocol implemented here. */
+
+#define PKTMAX 65520
+#define PKTDATAMAX (PKTMAX - 4)
+
+/* Append the payload of a packet read from standard input to buf.  Return
+ * 1 for a data packet, 0 for a flush packet, and -1 at end of input. */
+static int
+readpkt(Charv *buf)
+{
+	char hdr[5];
+	size_t n, len;
+	char *end;
+
+	if ((n = fread(hdr, 1, 4, stdin)) != 4) {
+		if (!n && feof(stdin))
+			return -1;
+		error(EXIT_FAILURE, 0, "git filter: truncated packet");
+	}
+	hdr[4] = '\0';
+	len = strtoul(hdr, &end, 16);
+	if (end != hdr + 4 || (len && len <= 4) || len > PKTMAX)
+		error(EXIT_FAILURE, 0, "git filter: bad packet length %s", hdr);
+	if (!len)
+		return 0;
+
+	len -= 4;
+	n = cv_size(buf);
+	cv_resize(buf, n + len);
+	if (fread(cv_getptr(buf, n), 1, len, stdin) != len)
+		error(EXIT_FAILURE, 0, "git filter: truncated packet");
+	return 1;
+}
+
+/* Read a text packet into buf without its trailing newline and NUL
+ * terminate it.  Return false at a flush packet. */
+static bool
+readtext(Charv *buf)
+{
+	int r;
+
+	cv_resize(buf, 0);
+	if ((r = readpkt(buf)) == -1)
+		error(EXIT_FAILURE, 0, "git filter: unexpected end of input");
+	if (!r)
+		return false;
+	if (cv_size(buf) && cv_top(buf) == '\n')
+		cv_pop(buf);
+	cv_push(buf, '\0');
+	return true;
+}
+
+static void
+writepkt(const char *data, size_t len)
+{
+	if (printf("%04zx", len + 4) < 0 || fwrite(data, 1, len, stdout) != len)
+		error(EXIT_FAILURE, 0, "git filter: output error");
+}
+
+static void
+writetext(const char *s)
+{
+	writepkt(s, strlen(s));
+}
+
+static void
+writeflush(void)
+{
+	if (fputs("0000", stdout) == EOF)
+		error(EXIT_FAILURE, 0, "git filter: output error");
+}
+
+static void
+handshake(Charv *buf)
+{
+	bool v2 = false, clean = false, smudge = false;
+	const char *s;
+
+	if (!readtext(buf) || strcmp(cv_getptr(buf, 0), "git-filter-client"))
+		error(EXIT_FAILURE, 0, "git filter: bad welcome message");
+	while (readtext(buf)) {
+		if (!strcmp(cv_getptr(buf, 0), "version=2"))
+			v2 = true;
+	}
+	if (!v2)
+		error(EXIT_FAILURE, 0, "git filter: protocol version 2 is not offered");
+
+	writetext("git-filter-server\n");
+	writetext("version=2\n");
+	writeflush();
+	fflush(stdout);
+
+	while (readtext(buf)) {
+		s = cv_getptr(buf, 0);
+		if (!strcmp(s, "capability=clean"))
+			clean = true;
+		else if (!strcmp(s, "capability=smudge"))
+			smudge = true;
+	}
+	if (clean)
+		writetext("capability=clean\n");
+	if (smudge)
+		writetext("capability=smudge\n");
+	writeflush();
+	fflush(stdout);
+}
+
+void
+gitfilter(Rules *rules, bool (*checkpoint)(void))
+{
+	Converter fwd, rev, *cvt;
+	Charv *buf = cv_new();
+	Charv *content = cv_new();
+	Charv *out = cv_new();
+	const char *s;
+	size_t i, n;
+	int r;
+	FILE *f;
+
+	cvt_init(&fwd, rules, false);
+	cvt_init(&rev, rules, true);
+
+	cv_reserve(buf, PKTMAX);
+	cv_reserve(content, BUFSIZ);
+	cv_reserve(out, BUFSIZ);
+
+	handshake(buf);
+
+	for (;;) {
+		cv_resize(buf, 0);
+		if ((r = readpkt(buf)) == -1)
+			break;
+
+		cvt = NULL;
+		while (r) {
+			cv_push(buf, '\0');
+			s = cv_getptr(buf, 0);
+			if (!strcmp(s, "command=smudge\n"))
+				cvt = &fwd;
+			else if (!strcmp(s, "command=clean\n"))
+				cvt = &rev;
+			cv_resize(buf, 0);
+			if ((r = readpkt(buf)) == -1)
+				error(EXIT_FAILURE, 0, "git filter: unexpected end of input");
+		}
+
+		cv_resize(content, 0);
+		while ((r = readpkt(content)) == 1);
+		if (r == -1)
+			error(EXIT_FAILURE, 0, "git filter: unexpected end of input");
+
+		if (checkpoint)
+			checkpoint();
+
+		if (!cvt) {
+			writetext("status=error\n");
+			writeflush();
+			fflush(stdout);
+			continue;
+		}
+
+		mt_start();
+		cv_resize(out, 0);
+		if (cv_size(content)) {
+			if (!(f = fmemopen(cv_getptr(content, 0), cv_size(content), "r")))
+				error(EXIT_FAILURE, errno, "fmemopen");
+			do {
+				convertline(cvt, f, out);
+				if (ferror(f))
+					error(EXIT_FAILURE, 0, "git filter: input error");
+			} while (!feof(f));
+			fclose(f);
+		}
+
+		writetext("status=success\n");
+		writeflush();
+		for (i = 0; i < cv_size(out); i += n) {
+			n = cv_size(out) - i;
+			if (n > PKTDATAMAX)
+				n = PKTDATAMAX;
+			writepkt(cv_getptr(out, i), n);
+		}
+		writeflush();
+		/* An empty list keeps the status. */
+		writeflush();
+		if (fflush(stdout) == EOF)
+			error(EXIT_FAILURE, errno, "git filter: output error");
+		mt_stop(cvt == &rev, cv_size(content), 0);
+	}
+
+	cvt_uninit(&fwd);
+	cvt_uninit(&rev);
+	cv_delete(buf);
+	cv_delete(content);
+	cv_delete(out);
+}
@@ -0,0 +1,15 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> "strmap.h" "rules.h" should be included before this header */
+
+/* Serve git's long-running filter process protocol on standard input and
+ * output: smudge converts to Unicode, clean converts back.  The rules
+ * must have been parsed for forward conversion.  checkpoint, unless NULL,
+ * is called before each file is converted, where *rules may be replaced,
+ * which it returns true for. */
+void gitfilter(Rules *rules, bool (*checkpoint)(void));
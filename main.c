@@ -18,137 +18,842 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "strmap.h"
 #include "util.h"
 #include "vec.h"
+#include "phmap.h"
 
 #include "misc.h"
 #include "rules.h"
 #include "restore.h"
+#include "convert.h"
+#include "gitfilter.h"
+#include "gen.h"
+#include "metrics.h"
+#include "slowlines.h"
+#include "profile.h"
+#include "rulesets.h"
+#include "watch.h"
 
-typedef struct {
-	size_t span;
-	const char *cchar;
-} CChar;
+#define OUTBUFSIZ 65536
+#define RECBUFSIZ 65536
+/* Regular files up to this size are read whole. */
+#define WHOLEMAX (4 << 20)
 
-static size_t
-mark(Node *nd, const char *const *tks, CChar *cchars, size_t i)
+/* Rules are reloaded on SIGHUP where no line or record is being converted,
+ * so the converters never see the rules change under them. */
+static volatile sig_atomic_t reloadreq;
+
+static struct {
+	const Strv *files;
+	const Rulefilter *filters;
+	bool reverse;
+	Rules *rules;
+	Rulesets *rulesets;
+} reload;
+
+static void
+onsighup(int sig)
 {
-	size_t j = i + 1, n = 0;
-	for (;;) {
-		if (nd->key) {
-			n = j - i;
-			cchars[i].cchar = nd->key;
+	reloadreq = 1;
+}
+
+static void
+watchsighup(const Strv *files, const Rulefilter *filters, bool reverse, Rules *rules)
+{
+	struct sigaction sa;
+
+	reload.files = files;
+	reload.filters = filters;
+	reload.reverse = reverse;
+	reload.rules = rules;
+
+	sa.sa_handler = onsighup;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGHUP, &sa, NULL))
+		error(EXIT_FAILURE, errno, "sigaction");
+}
+
+/* Reload the rules if requested, and return true if they were. */
+static bool
+checkreload(void)
+{
+	if (!reloadreq)
+		return false;
+	reloadreq = 0;
+	if (reload.rulesets? rs_reload(reload.rulesets, reload.files)
+	    : reloadrules(reload.files, reload.filters, reload.reverse, reload.rules)) {
+		mt_newgeneration();
+		error(0, 0, "reloaded rules");
+		return true;
+	}
+	error(0, 0, "failed to reload rules, keeping the old ones");
+	return false;
+}
+
+/* Count the rules hit into a profile written to fname at exit. */
+static void
+startprofile(Rules *rules, const char *fname)
+{
+	rules->profile = pf_new(rules);
+	clear_at_exit(rules->profile, PF_DELETE);
+	pf_writeatexit(rules->profile, fname);
+}
+
+/* Open an input file, "-" being standard input.  A regular file of up to
+ * WHOLEMAX bytes, or any input if whole is true, is read entirely into
+ * memory and served from there, which spares the per-block reads of stdio
+ * when converting many small files; otherwise stdio is used.  *pbuf is
+ * set to the buffer, to be freed after the stream is closed, or NULL, and
+ * *plen to its length. */
+static FILE *
+openinput(const char *fname, bool whole, char **pbuf, size_t *plen)
+{
+	struct stat st;
+	char *buf;
+	size_t len, cap;
+	ssize_t n;
+	bool isreg;
+	FILE *f;
+	int fd;
+
+	*pbuf = NULL;
+	*plen = 0;
+
+	if (!strcmp(fname, "-"))
+		fd = STDIN_FILENO;
+	else if ((fd = open(fname, O_RDONLY)) == -1)
+		return NULL;
+
+	isreg = !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0;
+
+	if (!whole && (!isreg || fd == STDIN_FILENO || st.st_size > WHOLEMAX))
+		return (fd == STDIN_FILENO? stdin: fdopen(fd, "r"));
+
+	cap = (isreg? st.st_size: BUFSIZ);
+	buf = xmalloc(cap);
+	for (len = 0; ; len += n) {
+		if (len == cap) {
+			if (isreg) break;
+			buf = xrealloc(buf, cap += cap / 2);
 		}
-		if (!nd->br || !(nd = sm_get(nd->br, tks[j])))
+		if ((n = read(fd, buf + len, cap - len)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n == -1) {
+				free(buf);
+				return NULL;
+			}
 			break;
-		++j;
+		}
+	}
+
+	if (fd == STDIN_FILENO) {
+		f = (len? fmemopen(buf, len, "r"): stdin);
+	} else if (len) {
+		f = fmemopen(buf, len, "r");
+		close(fd);
+	} else {
+		/* fmemopen() needn't support an empty buffer, stdio is at
+		 * end of file just as well. */
+		f = fdopen(fd, "r");
+	}
+	if (!f) {
+		free(buf);
+		return NULL;
 	}
-	cchars[i].span = n;
-	return n;
+	*pbuf = buf;
+	*plen = len;
+	return f;
 }
 
-static CChar *
-conceal(const Strmap *rtbr, const Strmap *subsbr, const Strmap *supsbr,
-        const bool test_rtbr_initial[static 256], const char **tks, size_t ntks)
+/* Find the first complete record in the bytes [*ppos, end) of in, set
+ * *pstart and *plen to its content and advance *ppos past it.  Return
+ * false if the record is incomplete. */
+static bool
+findrecord(const Charv *in, size_t *ppos, bool netstring, const char *fname,
+           size_t *pstart, size_t *plen)
 {
-	CChar *cchars = xcalloc(ntks, sizeof(*cchars));
-	size_t i, j, n;
-	Node *nd;
-	const Strmap *ssbr;
-	char c;
-	for (i = 0; i < ntks; ) {
-		assert(i < ntks);
-		c = *tks[i];
-		if (test_rtbr_initial[(unsigned char)c]) {
-			if ((nd = sm_get(rtbr, tks[i]))
-			    && (n = mark(nd, tks, cchars, i))
-			   ) {
-				i += n;
-				continue;
+	const char *s = cv_getptr(in, *ppos);
+	const char *end = cv_getptr(in, cv_size(in));
+	const char *p;
+	size_t len;
+
+	if (!netstring) {
+		if (!(p = memchr(s, NUL, end - s)))
+			return false;
+		*pstart = *ppos;
+		*plen = p - s;
+		*ppos += *plen + 1;
+		return true;
+	}
+
+	for (p = s, len = 0; p != end && isdigit((unsigned char)*p); ++p) {
+		if (len > (SIZE_MAX - 9) / 10)
+			error(EXIT_FAILURE, 0, "%s: netstring too long", fname);
+		len = 10 * len + (*p - '0');
+	}
+	if (p == end)
+		return false;
+	if (p == s || *p != ':')
+		error(EXIT_FAILURE, 0, "%s: malformed netstring", fname);
+	++p;
+	if (end - p <= len)
+		return false;
+	if (p[len] != ',')
+		error(EXIT_FAILURE, 0, "%s: malformed netstring", fname);
+	*pstart = p - cv_getptr(in, 0);
+	*plen = len;
+	*ppos = *pstart + len + 1;
+	return true;
+}
+
+/* Count the complete records in the bytes [pos, end) of in, stopping at
+ * any malformed one, which findrecord() will report in turn. */
+static size_t
+countrecords(const Charv *in, size_t pos, bool netstring)
+{
+	const char *p = cv_getptr(in, pos);
+	const char *end = cv_getptr(in, cv_size(in));
+	const char *q;
+	size_t n = 0, len;
+
+	for (;;) {
+		if (!netstring) {
+			if (!(p = memchr(p, NUL, end - p)))
+				return n;
+			++p;
+		} else {
+			for (q = p, len = 0; p != end && isdigit((unsigned char)*p); ++p) {
+				if (len > (SIZE_MAX - 9) / 10)
+					return n;
+				len = 10 * len + (*p - '0');
 			}
-			if ((c == tr('_') || c == tr('^')) && *tks[i + 1] == tr('{')) {
-				ssbr = (c == tr('_')? subsbr: supsbr);
-				i = j = i + 2;
-				for (;;) {
-					if ((nd = sm_get(ssbr, tks[i]))
-					    && (n = mark(nd, tks, cchars, i))) {
-						i += n;
-						if (*tks[i] == tr('}')) {
-							cchars[j - 2] = (CChar){ .span = 2, .cchar = "" };
-							cchars[i++] = (CChar){ .span = 1, .cchar = "" };
-							break;
-						}
-					} else {
-						cchars[j - 2].span = 0;
-						cchars[j - 1].span = 0;
-						i = j;
-						break;
-					}
+			if (p == q || p == end || *p++ != ':' || end - p <= len || p[len] != ',')
+				return n;
+			p += len + 1;
+		}
+		++n;
+	}
+}
+
+/* Convert records read from fd, each either terminated by a NUL byte or
+ * framed as a netstring, and print each result in the same framing.
+ * Output is flushed only when further input has to be waited for.  With
+ * metrics enabled, the records already read behind each are counted as
+ * its queue. */
+static void
+convertrecords(Converter *cvt, int fd, const char *fname, bool netstring, Charv *out)
+{
+	Charv *in = cv_new();
+	size_t pos = 0, start, len, queued = 0;
+	bool eof = false;
+	ssize_t n;
+	FILE *f;
+
+	cv_reserve(in, RECBUFSIZ);
+
+	for (;;) {
+		if (!findrecord(in, &pos, netstring, fname, &start, &len)) {
+			if (eof) {
+				if (pos == cv_size(in))
+					break;
+				if (netstring)
+					error(EXIT_FAILURE, 0, "%s: truncated netstring", fname);
+				start = pos;
+				len = cv_size(in) - pos;
+				pos = cv_size(in);
+			} else {
+				if (pos) {
+					memmove(cv_getptr(in, 0), cv_getptr(in, pos), cv_size(in) - pos);
+					cv_resize(in, cv_size(in) - pos);
+					pos = 0;
 				}
+				if (fflush(stdout) == EOF)
+					error(EXIT_FAILURE, errno, "output error");
+				cv_reserve(in, cv_size(in) + RECBUFSIZ);
+				n = read(fd, cv_getptr(in, cv_size(in)), RECBUFSIZ);
+				if (n == -1) {
+					if (errno == EINTR)
+						continue;
+					error(EXIT_FAILURE, errno, "input error during reading %s", fname);
+				}
+				if (n)
+					cv_resize(in, cv_size(in) + n);
+				else
+					eof = true;
 				continue;
 			}
 		}
 
-		cchars[i].span = 0;
-		++i;
+		if (queued)
+			--queued;
+		else if (mt_enabled())
+			queued = countrecords(in, pos, netstring);
+
+		checkreload();
+		mt_start();
+		if (len) {
+			if (!(f = fmemopen(cv_getptr(in, start), len, "r")))
+				error(EXIT_FAILURE, errno, "fmemopen");
+			do {
+				convertline(cvt, f, out);
+				if (ferror(f))
+					error(EXIT_FAILURE, 0, "input error during reading %s", fname);
+			} while (!feof(f));
+			fclose(f);
+		}
+
+		if ((netstring && printf("%zu:", cv_size(out)) < 0)
+		    || fwrite(cv_getptr(out, 0), 1, cv_size(out), stdout) != cv_size(out)
+		    || putchar(netstring? ',': NUL) == EOF)
+			error(EXIT_FAILURE, 0, "output error");
+		mt_stop(cvt->reverse, len, queued);
+		cv_resize(out, 0);
 	}
-	return cchars;
+
+	cv_delete(in);
 }
 
-static int
-puttks(const char *const *tks, const CChar *cchars)
+/* Lines converted in the background at a time by serveviews(), between
+ * which new requests are looked for. */
+#define VIEWCHUNK 256
+
+/* A buffer being converted by serveviews() with rules, held in the rule
+ * sets if held is true, and the classes of them to use.  Its text starts
+ * at base in text; lines holds the offsets of its lines from there, as
+ * far as they have been looked for, with that of the next line last, and
+ * allfound is set once they all have been.  todo holds the ranges of
+ * lines yet to convert, each a first and an end line index, the next on
+ * top; SIZE_MAX as an end stands for the number of lines.  Lines are
+ * looked for only as they are needed, so that a request takes time only
+ * for the lines in view. */
+typedef struct Viewjob {
+	struct Viewjob *next;
+	char *id;
+	Rules *rules;
+	bool held;
+	uint64_t classes;
+	Charv *text;
+	size_t base;
+	Idxv *lines;
+	bool allfound;
+	Idxv *todo;
+} Viewjob;
+
+static void
+freejob(Viewjob *job, Rulesets *rs)
 {
-	const char *s, *t;
-	char c;
-	size_t i;
-
-	for (i = 0; ; ) {
-		s = tks[i];
-		if (s[-1] != NUL) {
-			for (t = s - 1; t[-1] != NUL; --t);
-			do {
-				if (putchar(tr(*t++)) == EOF)
-					return EOF;
-			} while (t != s);
+	if (job->held)
+		rs_release(rs, job->rules);
+	free(job->id);
+	cv_delete(job->text);
+	iv_delete(job->lines);
+	iv_delete(job->todo);
+	free(job);
+}
+
+/* Look for the lines of job up to line n and return n, or the number of
+ * lines if fewer. */
+static size_t
+findlines(Viewjob *job, size_t n)
+{
+	const char *s = cv_getptr(job->text, job->base);
+	size_t len = cv_size(job->text) - job->base;
+	const char *nl;
+	size_t off;
+
+	while (!job->allfound && iv_size(job->lines) <= n) {
+		off = iv_top(job->lines);
+		nl = memchr(s + off, '\n', len - off);
+		iv_push(job->lines, (nl? nl + 1 - s: len));
+		if (!nl || nl + 1 - s == len)
+			job->allfound = true;
+	}
+	return (n < iv_size(job->lines)? n: iv_size(job->lines) - 1);
+}
+
+static bool
+pastdeadline(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec
+	       || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* Convert the lines of job from first up to end, or until the deadline
+ * unless it is NULL, appending those changed to resp as -d prints them.
+ * Return the index of the first line left unconverted. */
+static size_t
+convertlines(Converter *cvt, Viewjob *job, size_t first, size_t end,
+             const struct timespec *deadline, Charv *out, Charv *resp)
+{
+	const char *text = cv_getptr(job->text, job->base);
+	Rules *rules = cvt->rules;
+	uint64_t classes = cvt->classes;
+	const char *raw;
+	char num[24];
+	size_t i, len, n;
+	FILE *f;
+
+	if ((end = findlines(job, end)) <= first)
+		return end;
+	cvt->rules = job->rules;
+	cvt->classes = job->classes;
+	if (!(f = fmemopen((char *)text + iv_get(job->lines, first),
+	                   iv_get(job->lines, end) - iv_get(job->lines, first), "r")))
+		error(EXIT_FAILURE, errno, "fmemopen");
+	for (i = first; i < end && !(deadline && pastdeadline(deadline)); ++i) {
+		convertline(cvt, f, out);
+		if (ferror(f))
+			error(EXIT_FAILURE, 0, "input error during reading standard input");
+		raw = text + iv_get(job->lines, i);
+		len = iv_get(job->lines, i + 1) - iv_get(job->lines, i);
+		if (!cvt->reverse && len && *raw == '\x03') {
+			++raw;
+			--len;
 		}
-		if (cchars && cchars[i].span) {
-			s = cchars[i].cchar;
-			while ((c = *s++) != NUL) {
-				do {
-					if (putchar(tr(c)) == EOF)
-						return EOF;
-				} while ((c = *s++) != NUL);
-			}
-			i += cchars[i].span;
-		} else {
-			c = *s++;
-			if (c == tr('\n')) {
-				if (putchar('\n') == EOF)
-					return EOF;
-				return 0;
-			} else if (c == EOFBYTE) {
-				return 0;
-			} else if (c == ILSEQ) {
-				while ((c = *s++) != NUL) {
-					if (putchar(c) == EOF)
-						return EOF;
+		if (len != cv_size(out) || memcmp(raw, cv_getptr(out, 0), len)) {
+			if (cv_size(out) && cv_top(out) == '\n')
+				cv_pop(out);
+			len = sprintf(num, "%zu\t", i + 1);
+			n = cv_size(resp);
+			cv_resize(resp, n + len + cv_size(out) + 1);
+			memcpy(cv_getptr(resp, n), num, len);
+			memcpy(cv_getptr(resp, n + len), cv_getptr(out, 0), cv_size(out));
+			cv_set(resp, cv_size(resp) - 1, '\n');
+		}
+		cv_resize(out, 0);
+	}
+	fclose(f);
+	cvt->rules = rules;
+	cvt->classes = classes;
+	return i;
+}
+
+/* Print, framed as a netstring, the answer to a request for the buffer
+ * id that couldn't be taken: a header of the id, error and why. */
+static void
+putviewerror(const char *id, const char *why)
+{
+	int n = snprintf(NULL, 0, "%s error %s\n", id, why);
+
+	if (printf("%d:%s error %s\n,", n, id, why) < 0 || fflush(stdout) == EOF)
+		error(EXIT_FAILURE, errno, "output error");
+}
+
+/* Print, framed as a netstring, the lines of job from first up to end
+ * that were changed, collected in resp, after a header of the buffer id,
+ * the range, counting from 1, and how many bytes of the buffer are still
+ * to be converted. */
+static void
+putview(const Viewjob *job, size_t first, size_t end, Charv *resp)
+{
+	size_t len = cv_size(job->text) - job->base;
+	size_t left = 0, k, e;
+	int n;
+
+	for (k = 0; k < iv_size(job->todo); k += 2) {
+		e = iv_get(job->todo, k + 1);
+		left += (e < iv_size(job->lines)? iv_get(job->lines, e): len)
+		        - iv_get(job->lines, iv_get(job->todo, k));
+	}
+	n = snprintf(NULL, 0, "%s %zu %zu %zu\n", job->id, first + 1, end, left);
+	if (printf("%zu:%s %zu %zu %zu\n", n + cv_size(resp), job->id, first + 1, end, left) < 0
+	    || fwrite(cv_getptr(resp, 0), 1, cv_size(resp), stdout) != cv_size(resp)
+	    || putchar(',') == EOF || fflush(stdout) == EOF)
+		error(EXIT_FAILURE, errno, "output error");
+	cv_resize(resp, 0);
+}
+
+/* Take the request in the bytes [start, start + len) of text: a header
+ * line of a buffer id, the first and last line to convert first,
+ * optionally a deadline in milliseconds, optionally classes= and the
+ * classes of rules to use, and optionally rules= and the name of a rule
+ * set of rs to convert with, which runs to the end of the line, followed
+ * by the text of the buffer.  Return the buffer as a job with the lines
+ * not converted yet, which takes over text, those converted being
+ * [*pfirst, *pend), their changes in resp.  If the header is malformed or
+ * the rule set can't be loaded, answer with an error instead and return
+ * NULL, text being left to the caller. */
+static Viewjob *
+takeview(Converter *cvt, Rulesets *rs, Charv *text, size_t start, size_t len,
+         Charv *out, Charv *resp, size_t *pfirst, size_t *pend)
+{
+	const char *s = cv_getptr(text, start);
+	const char *nl = memchr(s, '\n', len);
+	Viewjob *job;
+	char *hdr, *p, *e, *name = NULL;
+	size_t first, last, ms, done;
+	struct timespec deadline;
+	bool hasdeadline = false;
+	uint64_t classes = cvt->classes;
+	Rules *rules = cvt->rules;
+
+	if (!nl) {
+		error(0, 0, "standard input: request without a header");
+		putviewerror("", "request without a header");
+		return NULL;
+	}
+	hdr = xmalloc(nl - s + 1);
+	memcpy(hdr, s, nl - s);
+	hdr[nl - s] = NUL;
+	if (!(p = strchr(hdr, ' ')) || p == hdr)
+		goto bad;
+	*p++ = NUL;
+	first = strtoul(p, &e, 10);
+	if (e == p || *e != ' ' || !first)
+		goto bad;
+	last = strtoul(p = e + 1, &e, 10);
+	if (e == p || last < first)
+		goto bad;
+	if (*e == ' ' && isdigit((unsigned char)e[1])) {
+		ms = strtoul(p = e + 1, &e, 10);
+		if (e == p)
+			goto bad;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ms / 1000 + (deadline.tv_nsec + ms % 1000 * 1000000) / 1000000000;
+		deadline.tv_nsec = (deadline.tv_nsec + ms % 1000 * 1000000) % 1000000000;
+		hasdeadline = true;
+	}
+	if (!strncmp(e, " classes=", 9))
+		e = (char *)parseclasses(e + 9, &classes);
+	if (!strncmp(e, " rules=", 7) && e[7] != NUL) {
+		name = e + 7;
+		e = name + strlen(name);
+	}
+	if (*e != NUL)
+		goto bad;
+	if (name && !(rules = rs_hold(rs, name))) {
+		error(0, 0, "standard input: couldn't load rule set %s", name);
+		putviewerror(hdr, "couldn't load rule set");
+		free(hdr);
+		return NULL;
+	}
+
+	job = xmalloc(sizeof(*job));
+	job->id = hdr;
+	job->rules = rules;
+	job->held = (name != NULL);
+	job->classes = classes;
+	job->text = text;
+	job->base = nl + 1 - cv_getptr(text, 0);
+	cv_resize(text, start + len);
+	job->lines = iv_new();
+	iv_push(job->lines, 0);
+	job->allfound = (job->base == cv_size(text));
+	job->todo = iv_new();
+
+	/* Lines past the range come next, then those before it. */
+	first = findlines(job, first - 1);
+	last = findlines(job, last);
+	if (first) {
+		iv_push(job->todo, 0);
+		iv_push(job->todo, first);
+	}
+	if (!job->allfound || last < iv_size(job->lines) - 1) {
+		iv_push(job->todo, last);
+		iv_push(job->todo, SIZE_MAX);
+	}
+	done = convertlines(cvt, job, first, last, hasdeadline? &deadline: NULL, out, resp);
+	if (done < last) {
+		iv_push(job->todo, done);
+		iv_push(job->todo, last);
+	}
+	*pfirst = first;
+	*pend = done;
+	return job;
+
+bad:
+	error(0, 0, "standard input: malformed request header: %.*s", (int)(nl - s), s);
+	hdr[strcspn(hdr, " ")] = NUL;
+	putviewerror(hdr, "malformed request header");
+	free(hdr);
+	return NULL;
+}
+
+/* Serve requests for conversion of whole buffers, framed as netstrings on
+ * standard input, converting first the lines in view and, if given a
+ * deadline, only as many as it allows.  The rest of each buffer is
+ * converted in the background, the newest buffer first, between looking
+ * for further requests; a request for a buffer of the same id drops what
+ * was left of the previous one. */
+static void
+serveviews(Converter *cvt, Rulesets *rs, Charv *out)
+{
+	Charv *in = cv_new();
+	Charv *resp = cv_new();
+	Charv *rest;
+	Viewjob *jobs = NULL, *job, **pjob;
+	struct pollfd pfd;
+	size_t pos = 0, start, len, njobs = 0, first = 0, end = 0, size;
+	bool eof = false;
+	ssize_t n;
+
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	cv_reserve(in, RECBUFSIZ);
+
+	for (;;) {
+		while (findrecord(in, &pos, true, "standard input", &start, &len)) {
+			/* The job takes over the input read so far, less
+			 * what follows the request, at most a read's worth. */
+			rest = cv_new();
+			cv_reserve(rest, RECBUFSIZ);
+			cv_resize(rest, cv_size(in) - pos);
+			memcpy(cv_getptr(rest, 0), cv_getptr(in, pos), cv_size(in) - pos);
+
+			checkreload();
+			mt_start();
+			job = takeview(cvt, rs, in, start, len, out, resp, &first, &end);
+			if (!job)
+				cv_delete(in);
+			in = rest;
+			pos = 0;
+			if (!job)
+				continue;
+			size = cv_size(job->text) - job->base;
+			putview(job, first, end, resp);
+			for (pjob = &jobs; *pjob; pjob = &(*pjob)->next) {
+				if (!strcmp((*pjob)->id, job->id)) {
+					Viewjob *old = *pjob;
+					*pjob = old->next;
+					freejob(old, rs);
+					--njobs;
+					break;
 				}
+			}
+			mt_stop(cvt->reverse, size, njobs);
+			if (iv_size(job->todo)) {
+				job->next = jobs;
+				jobs = job;
+				++njobs;
 			} else {
-				while (c != NUL) {
-					if (putchar(tr(c)) == EOF)
-						return EOF;
-					c = *s++;
-				}
+				freejob(job, rs);
+			}
+		}
+		if (eof) {
+			if (pos != cv_size(in))
+				error(EXIT_FAILURE, 0, "standard input: truncated netstring");
+			if (!jobs)
+				break;
+		} else if (!jobs || poll(&pfd, 1, 0) > 0) {
+			if (pos) {
+				memmove(cv_getptr(in, 0), cv_getptr(in, pos), cv_size(in) - pos);
+				cv_resize(in, cv_size(in) - pos);
+				pos = 0;
+			}
+			cv_reserve(in, cv_size(in) + RECBUFSIZ);
+			n = read(STDIN_FILENO, cv_getptr(in, cv_size(in)), RECBUFSIZ);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				error(EXIT_FAILURE, errno, "input error during reading standard input");
 			}
-			++i;
+			if (n)
+				cv_resize(in, cv_size(in) + n);
+			else
+				eof = true;
+			continue;
 		}
+
+		job = jobs;
+		first = iv_get(job->todo, iv_size(job->todo) - 2);
+		end = iv_top(job->todo);
+		end = convertlines(cvt, job, first, (end - first > VIEWCHUNK? first + VIEWCHUNK: end),
+		                   NULL, out, resp);
+		if (end == iv_top(job->todo) || (job->allfound && end == iv_size(job->lines) - 1))
+			iv_resize(job->todo, iv_size(job->todo) - 2);
+		else
+			iv_set(job->todo, iv_size(job->todo) - 2, end);
+		putview(job, first, end, resp);
+		if (!iv_size(job->todo)) {
+			jobs = job->next;
+			freejob(job, rs);
+			--njobs;
+		}
+	}
+
+	cv_delete(in);
+	cv_delete(resp);
+}
+
+/* Convert the lines read from f with cvt, up to but not including line
+ * end, and return the number of the first one whose result differs from
+ * the same line of the len bytes of text, or 0 if none does. */
+static size_t
+firstchanged(Converter *cvt, FILE *f, const char *text, size_t len, size_t end, Charv *out)
+{
+	const char *nl;
+	size_t off, n, lnum;
+	bool changed;
+
+	for (off = 0, lnum = 1; off < len && lnum != end; off += n, ++lnum) {
+		nl = memchr(text + off, '\n', len - off);
+		n = (nl? nl + 1 - text - off: len - off);
+		convertline(cvt, f, out);
+		changed = n != cv_size(out) || memcmp(text + off, cv_getptr(out, 0), n);
+		cv_resize(out, 0);
+		if (changed)
+			return lnum;
+	}
+	return 0;
+}
+
+/* Check that each line of the file is left as it is by reverse conversion
+ * (rev), and by conversion (fwd) and back, reporting the first line that
+ * isn't.  Return false if there is one.  Each pass goes over the whole
+ * file through a single stream, the conversion into conv. */
+static bool
+checkfile(Converter *fwd, Converter *rev, const char *fname, Charv *conv, Charv *out)
+{
+	FILE *f, *g;
+	char *buf;
+	size_t len, lnum, unrestored, unreturned = 0;
+
+	if (!(f = openinput(fname, true, &buf, &len)))
+		error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+	if (!strcmp(fname, "-"))
+		fname = "standard input";
+
+	unrestored = firstchanged(rev, f, buf, len, 0, out);
+	if (len) {
+		if (!(g = fmemopen(buf, len, "r")))
+			error(EXIT_FAILURE, errno, "fmemopen");
+		for (lnum = 1; !feof(g) && lnum != unrestored; ++lnum)
+			convertline(fwd, g, conv);
+		fclose(g);
+		if (!(g = fmemopen(cv_getptr(conv, 0), cv_size(conv), "r")))
+			error(EXIT_FAILURE, errno, "fmemopen");
+		unreturned = firstchanged(rev, g, buf, len, unrestored, out);
+		fclose(g);
+	}
+	if (unreturned)
+		error_at_line(0, 0, fname, unreturned, "line doesn't come back from conversion");
+	else if (unrestored)
+		error_at_line(0, 0, fname, unrestored, "line isn't restored");
+
+	if (f == stdin)
+		clearerr(f);
+	else
+		fclose(f);
+	free(buf);
+	cv_resize(conv, 0);
+	return !unreturned && !unrestored;
+}
+
+/* Totals of -e diff, which converts each line with both the fast engine
+ * and the reference one, timing each: lines, input bytes and nanoseconds
+ * taken by either engine. */
+static struct {
+	size_t lines;
+	size_t bytes;
+	uint64_t ns[2];
+} engines;
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void
+putthroughput(void)
+{
+	double mb = engines.bytes / 1e6;
+
+	error(0, 0, "%zu lines, %.1f MB; fast engine %.1f MB/s, reference engine %.1f MB/s",
+	      engines.lines, mb, (engines.ns[0]? mb * 1e9 / engines.ns[0]: 0),
+	      (engines.ns[1]? mb * 1e9 / engines.ns[1]: 0));
+}
+
+/* Convert the next line of f with cvt into out and the same line of g
+ * with ref, the reference engine, counting rawlen bytes of input, and
+ * exit if the two disagree.  g is NULL for empty input. */
+static void
+convertboth(Converter *cvt, FILE *f, Converter *ref, FILE *g, size_t rawlen,
+            Charv *out, Charv *refout, const char *fname, size_t lnum)
+{
+	uint64_t t0, t1, t2;
+	int n, refn;
+
+	/* Either engine goes first every other line, so that neither
+	 * always finds the line in cache. */
+	t0 = nsnow();
+	if (lnum % 2)
+		convertline(cvt, f, out);
+	else if (g)
+		convertline(ref, g, refout);
+	t1 = nsnow();
+	if (!(lnum % 2))
+		convertline(cvt, f, out);
+	else if (g)
+		convertline(ref, g, refout);
+	t2 = nsnow();
+	engines.ns[!(lnum % 2)] += t1 - t0;
+	engines.ns[lnum % 2] += t2 - t1;
+	engines.bytes += rawlen;
+	if (rawlen)
+		++engines.lines;
+
+	if (cv_size(out) != cv_size(refout)
+	    || memcmp(cv_getptr(out, 0), cv_getptr(refout, 0), cv_size(out))) {
+		n = cv_size(out) - (cv_size(out) && cv_top(out) == '\n');
+		refn = cv_size(refout) - (cv_size(refout) && cv_top(refout) == '\n');
+		error_at_line(0, 0, fname, lnum, "engines differ:\nfast:      %.*s\nreference: %.*s",
+		              n, cv_getptr(out, 0), refn, cv_getptr(refout, 0));
+		putthroughput();
+		exit(EXIT_FAILURE);
+	}
+	cv_resize(refout, 0);
+}
+
+/* Print the stretches of the last line converted by cvt that the
+ * conversion replaced, each as the line number, its start and end byte
+ * offsets in the input line and the replacement, separated by tabs. */
+static void
+putspans(const Converter *cvt, size_t lnum, const Charv *out)
+{
+	size_t k, in = 0, o = 0, nextin, nexto;
+
+	for (k = 0; ; k += 3) {
+		if (k < iv_size(cvt->map)) {
+			nextin = iv_get(cvt->map, k);
+			nexto = iv_get(cvt->map, k + 1);
+		} else {
+			nextin = cvt->inoff;
+			nexto = cv_size(out);
+		}
+		if (nextin != in || nexto != o) {
+			if (printf("%zu\t%zu\t%zu\t", lnum, in, nextin) < 0
+			    || fwrite(cv_getptr(out, o), 1, nexto - o, stdout) != nexto - o
+			    || putchar('\n') == EOF)
+				error(EXIT_FAILURE, 0, "output error");
+		}
+		if (k >= iv_size(cvt->map))
+			break;
+		in = nextin + iv_get(cvt->map, k + 2);
+		o = nexto + iv_get(cvt->map, k + 2);
 	}
 }
 
@@ -156,10 +861,31 @@ int
 main(int argc, char **argv)
 {
 	bool reverse = false;
+	bool diffmode = false;
+	bool spanmode = false;
+	bool gitmode = false;
+	bool viewmode = false;
+	bool checkmode = false;
+	bool slowmode = false;
+	bool genrules;
+	enum { NOREC, NULREC, NETSTRING } recordmode = NOREC;
+	enum { FAST, REFERENCE, DIFFERENTIAL } engine = FAST;
+	const char *mapfname = NULL, *metricsfname = NULL;
+	uint64_t slowns = 0;
+	size_t nslow = 10;
+	const char *styfname = NULL, *sedfname = NULL, *cfname = NULL;
+	const char *profilefname = NULL, *layoutfname = NULL;
+	const char *watchdir = NULL;
+	unsigned long watchms = 50;
+	unsigned long budget = 65536;
+	bool hasbudget = false;
+	uint64_t classes = ALLCLASSES;
+	Rulefilter *filters = NULL;
+	FILE *mapf = NULL;
 	Strv *rulesfiles = sv_new(),
 	     *files = sv_new();
-	Strmap *rtbr, *invbr, *subsbr, *supsbr;
-	static bool test_rtbr_initial[256];
+	static Rules rules;
+	static Converter cvt;
 
 	program_invocation_name = argv[0];
 
@@ -192,133 +918,489 @@ main(int argc, char **argv)
 				}
 			}
 		}
+		if (!sv_size(rulesfiles) && builtin_rules_textlen)
+			sv_push(rulesfiles, builtin_rules_name);
 	}
 
 	{
 		int opt;
 		FILE *hf;
+		char *e;
 
-		while ((opt = getopt(argc, argv, "ru:f:vh")) != -1) {
+		while ((opt = getopt(argc, argv, "rcdkwzZW:b:gp:t:T:P:e:s:S:C:L:u:f:m:M:l:vh")) != -1) {
 			switch (opt) {
 			case 'r':
 				reverse = true;
 				break;
+			case 'c':
+				checkmode = true;
+				break;
+			case 'd':
+				diffmode = true;
+				break;
+			case 'k':
+				spanmode = true;
+				break;
+			case 'w':
+				viewmode = true;
+				break;
+			case 'W':
+				/* The interval, if given, is the digits after
+				 * the last comma. */
+				watchdir = optarg;
+				if ((e = strrchr(optarg, ',')) && e[1] != NUL
+				    && strspn(e + 1, "0123456789") == strlen(e + 1)) {
+					watchms = strtoul(e + 1, NULL, 10);
+					*e = NUL;
+				}
+				if (*watchdir == NUL || !watchms)
+					error(EXIT_FAILURE, 0, "invalid argument to -W: %s", optarg);
+				break;
+			case 'b':
+				budget = strtoul(optarg, &e, 10);
+				if (e == optarg || *e != NUL)
+					error(EXIT_FAILURE, 0, "invalid argument to -b: %s", optarg);
+				hasbudget = true;
+				break;
+			case 'g':
+				gitmode = true;
+				break;
+			case 'z':
+				recordmode = NULREC;
+				break;
+			case 'Z':
+				recordmode = NETSTRING;
+				break;
+			case 'p':
+				mapfname = optarg;
+				break;
+			case 't':
+				metricsfname = optarg;
+				break;
+			case 'T':
+				slowmode = true;
+				slowns = (uint64_t)strtoul(optarg, &e, 10) * 1000;
+				if (e != optarg && *e == ',' && isdigit((unsigned char)e[1]))
+					nslow = strtoul(e + 1, &e, 10);
+				if (e == optarg || *e != NUL)
+					error(EXIT_FAILURE, 0, "invalid argument to -T: %s", optarg);
+				break;
+			case 'P':
+				profilefname = optarg;
+				break;
+			case 'e':
+				if (!strcmp(optarg, "fast"))
+					engine = FAST;
+				else if (!strcmp(optarg, "reference"))
+					engine = REFERENCE;
+				else if (!strcmp(optarg, "diff"))
+					engine = DIFFERENTIAL;
+				else
+					error(EXIT_FAILURE, 0, "unknown engine: %s", optarg);
+				break;
+			case 's':
+				styfname = optarg;
+				break;
+			case 'S':
+				sedfname = optarg;
+				break;
+			case 'C':
+				cfname = optarg;
+				break;
+			case 'L':
+				layoutfname = optarg;
+				break;
 			case 'u':
 				sv_resize(rulesfiles, 0);
 				/* FALLTHROUGH */
 			case 'f':
 				sv_push(rulesfiles, optarg);
 				break;
+			case 'm':
+			case 'M':
+				filters = rf_new(filters, optarg, opt == 'm');
+				break;
+			case 'l':
+				if (*parseclasses(optarg, &classes) != NUL)
+					error(EXIT_FAILURE, 0, "invalid argument to -l: %s", optarg);
+				break;
 			case 'v':
 				puts("1");
 				return 0;
 			case 'h':
 			default:
 				hf = (opt == 'h'? stdout: stderr);
-				fprintf(hf, "usage: %s [-r|-h|-v] [-u rules_file]... [-f rules_file]... [input_files...]\n", argv[0]);
+				fprintf(hf, "usage: %s [-r|-g|-h|-v] [-c|-d|-k|-w|-z|-Z] [-p map_file] [-t metrics_file] [-T us[,n]] [-P profile] [-W dir[,ms]] [-b kib] [-e engine] [-s style_file] [-S sed_script] [-C c_file] [-L profile] [-u rules_file]... [-f rules_file]... [-m n,pattern]... [-M n,pattern]... [-l classes] [input_files...]\n", argv[0]);
 				fputs("options:\n"
-				      "  -r         convert in reverse\n"
-				      "  -u <file>  specify the rules file to use\n"
-				      "  -f <file>  specify an additional rules file\n"
-				      "  -h         print this help and exit\n"
-				      "  -v         print version number and exit\n", hf);
+				      "  -r                convert in reverse\n"
+				      "  -c                check that input is left as it is by reverse conversion and by conversion and back\n"
+				      "  -d                print only changed lines, each prefixed by its number and a tab\n"
+				      "  -k                print the replaced spans of lines instead of the result\n"
+				      "  -w                serve requests converting the lines in view of a buffer first\n"
+				      "  -z                convert NUL-terminated records\n"
+				      "  -Z                convert records framed as netstrings\n"
+				      "  -g                serve as a git long-running filter process\n"
+				      "  -p <file>         write a mapping of input to output positions to the file\n"
+				      "  -t <file>         record conversion latencies, written to the file on SIGUSR1 and to standard error at exit\n"
+				      "  -T <us>[,<n>]     report at exit the n (10) slowest lines of those taking at least us microseconds\n"
+				      "  -P <file>         count the rules hit, by direction and by the tokens matched, into a profile written to the file at exit\n"
+				      "  -W <dir>[,<ms>]   convert the input files, and the *.tex files under input directories, into dir, and again as they change, looking every ms (50) milliseconds\n"
+				      "  -b <kib>          keep the rule sets named by -w requests, once idle, within kib (65536) KiB\n"
+				      "  -e <engine>       convert with the fast or the reference engine, or with both to compare them (diff)\n"
+				      "  -s <file>         generate a style file, and exit if no input file is given\n"
+				      "  -S <file>         generate a sed script, and exit if no input file is given\n"
+				      "  -C <file>         generate C source building the rules in, and exit if no input file is given\n"
+				      "  -L <file>         lay out the rules built in by -C with those hit most in the profile first\n"
+				      "  -u <file>         specify the rules file to use\n"
+				      "  -f <file>         specify an additional rules file\n"
+				      "  -m <n>,<pattern>  use rules whose <n>th field match <pattern>\n"
+				      "  -M <n>,<pattern>  use rules whose <n>th field doesn't match <pattern>\n"
+				      "  -l <classes>      convert with only the rules of the classes, letters as in their third field, and those of none\n"
+				      "  -h                print this help and exit\n"
+				      "  -v                print version number and exit\n", hf);
 				return opt != 'h';
 			}
 		}
 	}
 
+	if (checkmode + diffmode + spanmode + viewmode + (recordmode != NOREC) > 1)
+		error(EXIT_FAILURE, 0, "only one of -c, -d, -k, -w, and -z or -Z can be used");
+	if (mapfname && (recordmode != NOREC || viewmode || checkmode))
+		error(EXIT_FAILURE, 0, "-p can't be used with -c, -w, -z or -Z");
+	if (checkmode && reverse)
+		error(EXIT_FAILURE, 0, "-c can't be used with -r");
+	if (engine == DIFFERENTIAL && (checkmode || viewmode || recordmode != NOREC))
+		error(EXIT_FAILURE, 0, "-e diff can't be used with -c, -w, -z or -Z");
+	if (engine == REFERENCE && (spanmode || mapfname || profilefname || slowmode))
+		error(EXIT_FAILURE, 0, "-e reference can't be used with -k, -p, -P or -T");
+	if (slowmode && (checkmode || viewmode || recordmode != NOREC))
+		error(EXIT_FAILURE, 0, "-T can't be used with -c, -w, -z or -Z");
+	if (watchdir && (checkmode || diffmode || spanmode || viewmode || recordmode != NOREC
+	                 || mapfname || slowmode || engine == DIFFERENTIAL))
+		error(EXIT_FAILURE, 0, "-W can't be used with -c, -d, -k, -p, -w, -z, -Z, -T or -e diff");
+	if (cfname && filters)
+		error(EXIT_FAILURE, 0, "-C can't be used with -m or -M");
+	if (layoutfname && !cfname)
+		error(EXIT_FAILURE, 0, "-L can only be used with -C");
+	if (hasbudget && !viewmode)
+		error(EXIT_FAILURE, 0, "-b can only be used with -w");
+
 	if (!sv_size(rulesfiles))
 		error(EXIT_FAILURE, 0, "couldn't find any rules file");
 
 	while (optind < argc)
 		sv_push(files, argv[optind++]);
 
-	if (reverse) {
-		parserules(rulesfiles, &invbr, NULL, NULL, NULL, NULL);
-	} else {
-		parserules(rulesfiles, &invbr, &rtbr, &subsbr, &supsbr, test_rtbr_initial);
-		clear_at_exit(rtbr, BR_DELETE);
-		clear_at_exit(subsbr, BR_DELETE);
-		clear_at_exit(supsbr, BR_DELETE);
+	if (viewmode && sv_size(files))
+		error(EXIT_FAILURE, 0, "-w takes no input file");
+	if (watchdir && !sv_size(files))
+		error(EXIT_FAILURE, 0, "-W needs input files");
+
+	clear_at_exit(filters, RF_DELETE);
+
+	if (metricsfname)
+		mt_enable(metricsfname);
+
+	if (gitmode) {
+		if (reverse || checkmode || diffmode || spanmode || viewmode || recordmode != NOREC || mapfname
+		    || slowmode || engine != FAST || watchdir || classes != ALLCLASSES
+		    || styfname || sedfname || cfname || sv_size(files))
+			error(EXIT_FAILURE, 0, "-g takes no other option than -u, -f, -t and -P, and no input file");
+		parserules(rulesfiles, filters, false, &rules);
+		clear_at_exit(&rules, RULES_FREE);
+		if (profilefname)
+			startprofile(&rules, profilefname);
+		/* Served requests shouldn't wait for the tries. */
+		needtries(&rules, ALLTRIES);
+		watchsighup(rulesfiles, filters, false, &rules);
+		setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZ);
+		gitfilter(&rules, checkreload);
+		return 0;
 	}
 
-	clear_at_exit(invbr, BR_DELETE);
+	/* Generation takes the rules for forward conversion either way. */
+	genrules = styfname || sedfname || cfname;
+	parserules(rulesfiles, filters, reverse && !genrules, &rules);
+	clear_at_exit(&rules, RULES_FREE);
+	if (genrules)
+		needtries(&rules, ALLTRIES);
+	else if (viewmode)
+		needtries(&rules, reverse? INVTRIES: ALLTRIES);
+	if (profilefname)
+		startprofile(&rules, profilefname);
+
+	if (genrules) {
+		Profile *layout = NULL;
+		const char *fname;
+		FILE *f;
+		int k;
+
+		if (layoutfname) {
+			if (!(layout = pf_read(layoutfname, &rules)))
+				exit(EXIT_FAILURE);
+			clear_at_exit(layout, PF_DELETE);
+		}
+
+		for (k = 0; k < 3; ++k) {
+			if (!(fname = (k == 2? cfname: k? sedfname: styfname)))
+				continue;
+			if (!strcmp(fname, "-"))
+				f = stdout;
+			else if (!(f = fopen(fname, "w")))
+				error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+			if (k == 2)
+				gencsource(&rules, layout, rulesfiles, f);
+			else if (k)
+				gensed(&rules, reverse, f);
+			else
+				genstyle(&rules, f);
+			if (f == stdout? fflush(f) == EOF: fclose(f) == EOF)
+				error(EXIT_FAILURE, errno, "couldn't write %s", fname);
+		}
+		if (!sv_size(files))
+			return 0;
+	}
 
-	setvbuf(stdout, NULL, _IOLBF, 0);
+	cvt_init(&cvt, &rules, reverse);
+	cvt_useclasses(&cvt, classes);
+	clear_at_exit(cvt.cv, CV_DELETE);
+	clear_at_exit(cvt.iv, IV_DELETE);
+	clear_at_exit(cvt.ib, IV_DELETE);
+	if (engine == REFERENCE)
+		cvt_usereference(&cvt);
+	if (slowmode) {
+		cvt_time(&cvt);
+		sl_enable(slowns, nslow);
+	}
+
+	if (mapfname && !(mapf = fopen(mapfname, "w")))
+		error(EXIT_FAILURE, errno, "couldn't open %s", mapfname);
+	if (mapf || spanmode) {
+		cvt_trackpositions(&cvt);
+		clear_at_exit(cvt.rt, IV_DELETE);
+		clear_at_exit(cvt.map, IV_DELETE);
+		clear_at_exit(cvt.stretches, IV_DELETE);
+		clear_at_exit(cvt.raw, CV_DELETE);
+		clear_at_exit(cvt.bounds, IV_DELETE);
+	} else if (mt_enabled() && engine == FAST) {
+		cvt_measureinput(&cvt);
+		clear_at_exit(cvt.rt, IV_DELETE);
+	}
+
+	if (viewmode) {
+		Charv *out = cv_new();
+		Rulesets *rs = rs_new(&rules, filters, reverse && !genrules,
+		                      budget > SIZE_MAX / 1024? SIZE_MAX: budget * 1024);
+
+		clear_at_exit(out, CV_DELETE);
+		clear_at_exit(rs, RS_DELETE);
+		watchsighup(rulesfiles, filters, reverse && !genrules, &rules);
+		reload.rulesets = rs;
+		setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZ);
+		serveviews(&cvt, rs, out);
+		return 0;
+	}
+
+	if (watchdir) {
+		watchsighup(rulesfiles, filters, reverse && !genrules, &rules);
+		setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZ);
+		watchfiles(&cvt, files, watchdir, watchms, checkreload);
+		return 0;
+	}
 
 	if (!sv_size(files)) sv_push(files, "-");
 
+	if (checkmode) {
+		static Converter rev;
+		Charv *conv = cv_new();
+		Charv *out = cv_new();
+		bool ok = true;
+		size_t i;
+
+		cvt_init(&rev, &rules, true);
+		cvt_useclasses(&rev, classes);
+		if (engine == REFERENCE)
+			cvt_usereference(&rev);
+		clear_at_exit(rev.cv, CV_DELETE);
+		clear_at_exit(rev.iv, IV_DELETE);
+		clear_at_exit(rev.ib, IV_DELETE);
+		clear_at_exit(conv, CV_DELETE);
+		clear_at_exit(out, CV_DELETE);
+		for (i = 0; i < sv_size(files); ++i) {
+			if (!checkfile(&cvt, &rev, sv_get(files, i), conv, out))
+				ok = false;
+		}
+		return !ok;
+	}
+
 	{
-		FILE *f;
+		/* Output is flushed line by line only when standard input is
+		 * read, where the other end may be waiting for each line;
+		 * records are flushed by convertrecords() instead. */
+		bool readstdin = false;
+		size_t i;
+
+		for (i = 0; i < sv_size(files); ++i) {
+			if (!strcmp(sv_get(files, i), "-"))
+				readstdin = true;
+		}
+		/* Reading standard input, unitex may be kept running. */
+		if (readstdin)
+			watchsighup(rulesfiles, filters, reverse && !genrules, &rules);
+		if (readstdin && recordmode == NOREC)
+			setvbuf(stdout, NULL, _IOLBF, 0);
+		else
+			setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZ);
+	}
+
+	{
+		FILE *f, *g = NULL;
 		const char *fname;
+		char *fbuf;
+		size_t fbuflen, off, rawlen, lnum;
+		int ch;
 		size_t i;
-		Charv *cv = cv_new();
-		Idxv *iv = iv_new();
-		Idxv *ib = iv_new();
+		Charv *out = cv_new();
+		Charv *refout = NULL;
+		static Converter ref;
 
-		clear_at_exit(cv, CV_DELETE);
-		clear_at_exit(iv, IV_DELETE);
-		clear_at_exit(ib, IV_DELETE);
+		clear_at_exit(out, CV_DELETE);
+		cv_reserve(out, BUFSIZ);
+
+		if (engine == DIFFERENTIAL) {
+			cvt_init(&ref, &rules, reverse);
+			cvt_usereference(&ref);
+			cvt_useclasses(&ref, classes);
+			clear_at_exit(ref.cv, CV_DELETE);
+			clear_at_exit(ref.iv, IV_DELETE);
+			clear_at_exit(ref.ib, IV_DELETE);
+			refout = cv_new();
+			clear_at_exit(refout, CV_DELETE);
+		}
 
 		for (i = 0; i < sv_size(files); ++i) {
 			fname = sv_get(files, i);
 
-			if (!strcmp(fname, "-")) {
-				f = stdin;
-				fname = "standard input";
-			} else if (!(f = fopen(fname, "r"))) {
-				error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+			if (recordmode != NOREC) {
+				int fd;
+
+				if (!strcmp(fname, "-")) {
+					fd = STDIN_FILENO;
+					fname = "standard input";
+				} else if ((fd = open(fname, O_RDONLY)) == -1) {
+					error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+				}
+				convertrecords(&cvt, fd, fname, recordmode == NETSTRING, out);
+				if (fd != STDIN_FILENO && close(fd))
+					error(EXIT_FAILURE, errno, "couldn't close %s", fname);
+				continue;
 			}
 
+			/* The reference engine doesn't measure the lines it
+			 * reads, so their lengths for -t come from the buffer. */
+			if (!(f = openinput(fname, diffmode || refout
+			                           || (engine == REFERENCE && mt_enabled()),
+			                    &fbuf, &fbuflen)))
+				error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+			if (!strcmp(fname, "-"))
+				fname = "standard input";
+			/* The reference engine reads the input over again. */
+			if (refout && fbuflen && !(g = fmemopen(fbuf, fbuflen, "r")))
+				error(EXIT_FAILURE, errno, "fmemopen");
+
+			off = rawlen = 0;
+			lnum = 0;
 			do {
-				bool doconceal;
-				const char **tks;
-				size_t ntks, j;
-				CChar *cchars;
+				++lnum;
 
-				if (reverse) {
-					doconceal = false;
+				/* Rules reloaded while waiting for a line apply
+				 * to it, and its latency counts from when it
+				 * begins to arrive.  The last time round, which
+				 * finds the end of the input, has no line to
+				 * map or time. */
+				ch = NUL;
+				if ((reload.rules || mt_enabled() || sl_enabled() || mapf)
+				    && (ch = getc(f)) != EOF)
+					ungetc(ch, f);
+				checkreload();
+				mt_start();
+				sl_start();
+				/* The line about to be read is the input up to
+				 * and including the next newline. */
+				if (fbuf) {
+					const char *nl = memchr(fbuf + off, '\n', fbuflen - off);
+
+					rawlen = (nl? nl + 1 - fbuf - off: fbuflen - off);
+				}
+				if (refout) {
+					convertboth(&cvt, f, &ref, g, rawlen, out, refout, fname, lnum);
 				} else {
-					char c = getc(f);
-					if (c == '\x03') {
-						doconceal = false;
-					} else {
-						ungetc(c, f);
-						doconceal = true;
-					}
+					convertline(&cvt, f, out);
 				}
-
-				getrestoredline(invbr, cv, iv, ib, f);
 				if (ferror(f))
 					error(EXIT_FAILURE, 0, "input error during reading %s", fname);
 
-				assert(cv_get(cv, iv_top(iv)) == tr('\n') || cv_get(cv, iv_top(iv)) == EOFBYTE);
+				if (mapf && ch != EOF) {
+					size_t k;
 
-				ntks = iv_size(iv);
-				tks = xcalloc(ntks, sizeof(*tks));
-				for (j = ntks; j--; )
-					tks[j] = cv_getptr(cv, iv_get(iv, j));
+					fprintf(mapf, "%zu\t", lnum);
+					for (k = 0; k < iv_size(cvt.map); k += 3) {
+						fprintf(mapf, "%s%zu,%zu,%zu", k? " ": "",
+						        iv_get(cvt.map, k), iv_get(cvt.map, k + 1),
+						        iv_get(cvt.map, k + 2));
+					}
+					if (putc('\n', mapf) == EOF)
+						error(EXIT_FAILURE, 0, "output error on %s", mapfname);
+				}
 
-				if (doconceal)
-					cchars = conceal(rtbr, subsbr, supsbr, test_rtbr_initial, (const char**)tks, ntks);
-				else
-					cchars = NULL;
-					
-				if (puttks(tks, cchars) == EOF)
-					error(EXIT_FAILURE, 0, "output error");
+				if (spanmode) {
+					putspans(&cvt, lnum, out);
+				} else if (diffmode) {
+					const char *raw = fbuf + off;
+					size_t len = rawlen;
 
-				free(cchars);
-				free(tks);
+					if (!reverse && len && *raw == '\x03') {
+						++raw;
+						--len;
+					}
+					if (len != cv_size(out)
+					    || memcmp(raw, cv_getptr(out, 0), len)) {
+						if (cv_size(out) && cv_top(out) == '\n')
+							cv_pop(out);
+						if (printf("%zu\t", lnum) < 0
+						    || fwrite(cv_getptr(out, 0), 1, cv_size(out), stdout) != cv_size(out)
+						    || putchar('\n') == EOF)
+							error(EXIT_FAILURE, 0, "output error");
+					}
+				} else if (fwrite(cv_getptr(out, 0), 1, cv_size(out), stdout) != cv_size(out)) {
+					error(EXIT_FAILURE, 0, "output error");
+				}
 
-				cv_resize(cv, 0);
-				iv_resize(iv, 0);
+				if (ch != EOF) {
+					mt_stop(reverse, (fbuf? rawlen: cvt.inoff), 0);
+					sl_stop(fname, lnum, cvt.ntks, cvt.depth, cvt.ns);
+				}
+				cv_resize(out, 0);
+				off += rawlen;
 			} while (!feof(f));
 
 			if (f == stdin)
 				clearerr(f);
 			else if (fclose(f) == EOF)
 				error(EXIT_FAILURE, errno, "couldn't close %s", fname);
+			if (g) {
+				fclose(g);
+				g = NULL;
+			}
+			free(fbuf);
 		}
+
+		if (fflush(stdout) == EOF)
+			error(EXIT_FAILURE, errno, "output error");
+		if (refout)
+			putthroughput();
+		if (mapf && fclose(mapf) == EOF)
+			error(EXIT_FAILURE, errno, "output error on %s", mapfname);
 	}
 
 	return 0;
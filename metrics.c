@@ -0,0 +1,273 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "metrics.h"
+
+/* Latencies, in nanoseconds, are counted in SUB bins per power of two,
+ * exactly below 2 * SUB and otherwise to within 1 / SUB, in the manner of
+ * HDR histograms; the last bin takes whatever exceeds some 18 minutes. */
+#define SUBBITS 4
+#define SUB (1 << SUBBITS)
+#define NBINS (SUB * 40)
+
+/* Inputs are sized in powers of 16 bytes, from below 256 up. */
+#define NSIZES 4
+
+/* Queue depths are counted in powers of two: 0, 1, 2-3, 4-7 and so on. */
+#define NQUEUED 16
+
+typedef struct {
+	unsigned long count;
+	uint64_t max;
+	unsigned long bins[NBINS];
+} Histogram;
+
+static const char *const dirnames[] = { "conceal", "restore" };
+static const char *const sizenames[NSIZES] = { "<256", "<4K", "<64K", ">=64K" };
+
+static bool enabled;
+static const char *dumpfname;
+static struct timespec start;
+static Histogram hists[2][NSIZES];
+static unsigned long queuedbins[NQUEUED];
+static unsigned long generation = 1, requests, sincereload;
+
+static size_t
+bin(uint64_t v)
+{
+	unsigned int s = 0;
+
+	while (v >> s >= 2 * SUB)
+		++s;
+	return (SUB * s + (v >> s) < NBINS? SUB * s + (v >> s): NBINS - 1);
+}
+
+/* The largest latency counted in bin i. */
+static uint64_t
+binmax(size_t i)
+{
+	unsigned int s;
+
+	if (i < 2 * SUB)
+		return i;
+	s = i / SUB - 1;
+	return ((uint64_t)(i - SUB * s + 1) << s) - 1;
+}
+
+/* The metrics are written from the signal handler, so only with write(),
+ * through this buffer. */
+static char outbuf[512];
+static size_t outlen;
+static int outfd;
+
+static void
+flushout(void)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < outlen) {
+		if ((n = write(outfd, outbuf + off, outlen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+	outlen = 0;
+}
+
+static void
+putstr(const char *s)
+{
+	while (*s != '\0') {
+		if (outlen == sizeof(outbuf))
+			flushout();
+		outbuf[outlen++] = *s++;
+	}
+}
+
+static void
+putnum(uint64_t v)
+{
+	char buf[24];
+	size_t i = sizeof(buf);
+
+	buf[--i] = '\0';
+	do {
+		buf[--i] = '0' + v % 10;
+	} while (v /= 10);
+	putstr(buf + i);
+}
+
+/* Nanoseconds as microseconds, rounded up. */
+static void
+putusec(uint64_t v)
+{
+	putnum((v + 999) / 1000);
+}
+
+/* Write the metrics to fd.  Counts are updated bin first, so that a dump
+ * interrupting an update at worst misses the latest request. */
+static void
+dump(int fd)
+{
+	static const unsigned int permille[] = { 500, 900, 990, 999 };
+	const Histogram *h;
+	unsigned long rank, n;
+	uint64_t v;
+	size_t d, k, q, i;
+
+	outfd = fd;
+	outlen = 0;
+
+	putstr("# unitex latencies in microseconds\ngeneration\t");
+	putnum(generation);
+	putstr("\trequests\t");
+	putnum(requests);
+	putstr("\tsince_reload\t");
+	putnum(sincereload);
+	putstr("\ndirection\tsize\tcount\tp50\tp90\tp99\tp99.9\tmax\n");
+	for (d = 0; d < 2; ++d) {
+		for (k = 0; k < NSIZES; ++k) {
+			h = &hists[d][k];
+			if (!h->count)
+				continue;
+			putstr(dirnames[d]);
+			putstr("\t");
+			putstr(sizenames[k]);
+			putstr("\t");
+			putnum(h->count);
+			for (q = 0; q < sizeof(permille) / sizeof(*permille); ++q) {
+				rank = (h->count * permille[q] + 999) / 1000;
+				for (i = 0, n = h->bins[0]; n < rank && i < NBINS - 1; )
+					n += h->bins[++i];
+				v = binmax(i);
+				putstr("\t");
+				putusec(v < h->max? v: h->max);
+			}
+			putstr("\t");
+			putusec(h->max);
+			putstr("\n");
+		}
+	}
+	putstr("queued\tcount\n");
+	for (k = 0; k < NQUEUED; ++k) {
+		if (!queuedbins[k])
+			continue;
+		putnum(k? (uint64_t)1 << (k - 1): 0);
+		if (k == NQUEUED - 1) {
+			putstr("+");
+		} else if (k > 1) {
+			putstr("-");
+			putnum(((uint64_t)1 << k) - 1);
+		}
+		putstr("\t");
+		putnum(queuedbins[k]);
+		putstr("\n");
+	}
+	flushout();
+}
+
+static void
+ondump(int sig)
+{
+	int saved = errno;
+	int fd = open(dumpfname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+	if (fd != -1) {
+		dump(fd);
+		close(fd);
+	}
+	errno = saved;
+}
+
+static void
+dumpatexit(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	dump(STDERR_FILENO);
+}
+
+void
+mt_enable(const char *fname)
+{
+	struct sigaction sa;
+
+	enabled = true;
+	dumpfname = fname;
+
+	sa.sa_handler = ondump;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL))
+		error(EXIT_FAILURE, errno, "sigaction");
+	if (atexit(dumpatexit))
+		error(EXIT_FAILURE, 0, "atexit failed");
+}
+
+bool
+mt_enabled(void)
+{
+	return enabled;
+}
+
+void
+mt_start(void)
+{
+	if (enabled)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+void
+mt_stop(bool reverse, size_t size, size_t queued)
+{
+	struct timespec end;
+	Histogram *h;
+	uint64_t v;
+	size_t k;
+
+	if (!enabled)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	v = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+
+	for (k = 0; k < NSIZES - 1 && size >= (size_t)256 << 4 * k; ++k);
+	h = &hists[reverse][k];
+	++h->bins[bin(v)];
+	if (v > h->max)
+		h->max = v;
+	++h->count;
+
+	for (k = 0; k < NQUEUED - 1 && queued >> k; ++k);
+	++queuedbins[k];
+
+	++requests;
+	++sincereload;
+}
+
+void
+mt_newgeneration(void)
+{
+	++generation;
+	sincereload = 0;
+}
@@ -0,0 +1,22 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stddef.h> should be included before this header */
+
+/* Latencies of conversion requests, each a line, a record, the lines in
+ * view of a buffer or a file served to git, from the input being at hand
+ * to the result being written.  They are kept in histograms by direction
+ * and by the size of the input, along with how many records or buffers
+ * were queued behind each request and the generation of the rules,
+ * counting reloads.  Once enabled, the metrics are written to fname on
+ * SIGUSR1 and to standard error at exit; until then the other calls do
+ * nothing. */
+void mt_enable(const char *fname);
+bool mt_enabled(void);
+void mt_start(void);
+void mt_stop(bool reverse, size_t size, size_t queued);
+void mt_newgeneration(void);
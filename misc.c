@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -16,6 +17,10 @@
 #include "vec.h"
 
 #include "misc.h"
+#include "rules.h"
+#include "profile.h"
+#include "rulesets.h"
+#include "probes.h"
 
 bool
 readutf8tail(Charv *cv, unsigned char c, FILE *f)
@@ -93,16 +98,75 @@ Node *
 nd_new()
 {
 	Node *ret = xmalloc(sizeof(*ret));
-	*ret = (Node){ .br = NULL, .key = NULL };
+	*ret = (Node){ .br = NULL, .key = NULL, .classes = 0, .alts = NULL };
+	return ret;
+}
+
+Node *
+nd_copy(const Node *nd)
+{
+	Node *ret = nd_new();
+	const Alt *alt;
+	Alt **palt = &ret->alts;
+
+	ret->key = nd->key;
+	ret->classes = nd->classes;
+	ret->br = (nd->br? sm_copy(nd->br): NULL);
+	for (alt = nd->alts; alt; alt = alt->next) {
+		*palt = xmalloc(sizeof(**palt));
+		**palt = *alt;
+		palt = &(*palt)->next;
+	}
+	*palt = NULL;
 	return ret;
 }
 
 void
 nd_delete(Node *nd)
 {
+	Alt *alt, *next;
+
+	for (alt = nd->alts; alt; alt = next) {
+		next = alt->next;
+		free(alt);
+	}
 	free(nd);
 }
 
+void
+nd_setkey(Node *nd, const char *key, uint64_t classes)
+{
+	Alt *alt, **palt;
+
+	if (nd->key && (nd->classes & ~classes)) {
+		alt = xmalloc(sizeof(*alt));
+		*alt = (Alt){ .key = nd->key, .classes = nd->classes, .next = nd->alts };
+		nd->alts = alt;
+	}
+	for (palt = &nd->alts; (alt = *palt); ) {
+		if ((alt->classes &= ~classes)) {
+			palt = &alt->next;
+		} else {
+			*palt = alt->next;
+			free(alt);
+		}
+	}
+	nd->key = key;
+	nd->classes = classes;
+}
+
+const char *
+nd_altkey(const Node *nd, uint64_t classes)
+{
+	const Alt *alt;
+
+	for (alt = nd->alts; alt; alt = alt->next) {
+		if (alt->classes & classes)
+			return alt->key;
+	}
+	return NULL;
+}
+
 static void
 delete_br_pair(const char *key, void *value)
 {
@@ -120,6 +184,78 @@ br_delete(Strmap *br)
 	sm_delete(br);
 }
 
+void
+br_deleteover(Strmap *br, const Strmap *base)
+{
+	const struct StrmapCell *cell;
+	Node *nd, *basend;
+	size_t i;
+
+	for (i = 0; i < br->len; ++i) {
+		for (cell = br->cellarr + i; cell && cell->key; cell = cell->next) {
+			nd = cell->value;
+			basend = (base? sm_get(base, cell->key): NULL);
+			if (nd == basend)
+				continue;
+			if (nd->br)
+				br_deleteover(nd->br, basend? basend->br: NULL);
+			nd_delete(nd);
+		}
+	}
+	sm_delete(br);
+}
+
+size_t
+br_sizeover(const Strmap *br, const Strmap *base)
+{
+	const struct StrmapCell *cell;
+	const Node *nd, *basend;
+	const Alt *alt;
+	size_t size = sizeof(*br) + br->len * sizeof(*br->cellarr), i;
+
+	for (i = 0; i < br->len; ++i) {
+		for (cell = br->cellarr + i; cell && cell->key; cell = cell->next) {
+			if (cell != br->cellarr + i)
+				size += sizeof(*cell);
+			nd = cell->value;
+			basend = (base? sm_get(base, cell->key): NULL);
+			if (nd == basend)
+				continue;
+			size += sizeof(*nd);
+			for (alt = nd->alts; alt; alt = alt->next)
+				size += sizeof(*alt);
+			if (nd->br)
+				size += br_sizeover(nd->br, basend? basend->br: NULL);
+		}
+	}
+	return size;
+}
+
+#ifdef USE_SDT
+
+/* The semaphores go where tracers look for them, as dtrace -G puts them. */
+#define PROBE_DEFINE(name) \
+	unsigned short PROBE_SEMAPHORE(name) __attribute__((section(".probes")));
+PROBES(PROBE_DEFINE)
+
+const char *
+probetext(const char *tks)
+{
+	static char buf[256];
+	size_t n = 0;
+
+	for (; *tks != NUL; ++tks) {
+		while (*tks != NUL && n < sizeof(buf) - 1)
+			buf[n++] = tr(*tks++);
+		while (*tks != NUL)
+			++tks;
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+#endif
+
 #ifndef NDEBUG
 
 #define list clear_at_exit_list
@@ -140,6 +276,10 @@ do_clear_at_exit()
 		case IV_DELETE: iv_delete(p); break;
 		case SV_DELETE: sv_delete(p); break;
 		case BR_DELETE: br_delete(p); break;
+		case RF_DELETE: rf_delete(p); break;
+		case RULES_FREE: freerules(p); break;
+		case PF_DELETE: pf_delete(p); break;
+		case RS_DELETE: rs_delete(p); break;
 		default: assert(0);
 		}
 	}
@@ -5,27 +5,54 @@
  *  file. If not, see <http://www.gnu.org/licenses>.
  */
 
-/* <stdbool.h> <stdio.h> "strmap.h" "vec.h" should be included before this header */
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" should be included before this header */
 
 enum { NUL, EOFBYTE, ILSEQ };
 #define tr(C) ((char)((C) ^ 0xf8))
 
+/* An earlier rule of a node of a trie, kept for the classes of it that no
+ * later rule of the node has. */
+typedef struct Alt {
+	const char *key;
+	uint64_t classes;
+	struct Alt *next;
+} Alt;
+
+/* A node of a trie, with the classes of the rule of key if it has one,
+ * the last read, and in alts those of the earlier rules still used with
+ * some classes, the later first. */
 typedef struct {
 	Strmap *br;
 	const char *key;
+	uint64_t classes;
+	Alt *alts;
 } Node;
 
+/* The key of the last rule read of nd of a class in classes, or NULL. */
+#define nd_key(nd, cls) \
+	((nd)->classes & (cls)? (nd)->key: (nd)->alts? nd_altkey((nd), (cls)): NULL)
+
 bool readutf8tail(Charv *cv, unsigned char head, FILE *f);
 
 size_t readtk(Charv *cv, FILE *f);
 
 Node *nd_new(void);
+/* A copy of nd sharing the nodes of its branches. */
+Node *nd_copy(const Node *nd);
 void nd_delete(Node *nd);
+/* Make key the rule of nd, keeping the earlier ones for the classes it
+ * doesn't have. */
+void nd_setkey(Node *nd, const char *key, uint64_t classes);
+const char *nd_altkey(const Node *nd, uint64_t classes);
 void br_delete(Strmap *br);
+/* Delete a trie laid over base, leaving the nodes it shares with it. */
+void br_deleteover(Strmap *br, const Strmap *base);
+/* The bytes taken by a trie laid over base, less the nodes it shares. */
+size_t br_sizeover(const Strmap *br, const Strmap *base);
 
 #ifdef NDEBUG
 #define clear_at_exit(P, M) ((void)0)
 #else
-typedef enum { FREE, CV_DELETE, IV_DELETE, SV_DELETE, BR_DELETE } CLEAR_METHOD;
+typedef enum { FREE, CV_DELETE, IV_DELETE, SV_DELETE, BR_DELETE, RF_DELETE, RULES_FREE, PF_DELETE, RS_DELETE } CLEAR_METHOD;
 void clear_at_exit(void *p, CLEAR_METHOD m);
 #endif
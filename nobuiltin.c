@@ -0,0 +1,21 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* No built-in rules, for building the program that generates them. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "strmap.h"
+#include "vec.h"
+
+#include "rules.h"
+
+const Rules builtin_rules;
+const char builtin_rules_text[] = "";
+const size_t builtin_rules_textlen = 0;
@@ -0,0 +1,244 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "phmap.h"
+
+/* Keys are put into buckets of about this size, and each bucket gets the
+ * displacement that puts all its keys into free slots.  Buckets of a
+ * single key, placed last, instead get the slot itself, marked by DIRECT,
+ * as the last free slots would take long to hit. */
+#define BUCKETSIZE 2
+#define MAXDISP (1 << 16)
+#define DIRECT ((uint32_t)1 << 31)
+/* Seeds tried before giving up, which takes keys that hash alike. */
+#define MAXSEEDS 64
+
+struct Phmap {
+	size_t n;
+	size_t nbuckets;
+	uint64_t seed;
+	uint32_t *disp;
+	const char **keys;
+	void **values;
+};
+
+static uint64_t
+mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	return h;
+}
+
+/* The seed goes into every byte, so that no two keys hash alike for all
+ * seeds. */
+static uint64_t
+hash(const char *s, uint64_t seed)
+{
+	uint64_t h = seed;
+	while (*s != '\0')
+		h = mix(h ^ (unsigned char)*s++ ^ seed);
+	return h;
+}
+
+/* Map the high and low halves of h to [0, n) without division. */
+#define HIGH(h, n) ((size_t)(((h) >> 32) * (n) >> 32))
+#define LOW(h, n) ((size_t)(((h) & 0xffffffff) * (n) >> 32))
+
+static size_t
+bucket(const Phmap *ph, uint64_t h)
+{
+	return HIGH(h, ph->nbuckets);
+}
+
+static size_t
+slot(const Phmap *ph, uint64_t h, uint32_t d)
+{
+	return LOW(mix(h ^ d), ph->n);
+}
+
+/* State of collect(), which sm_foreach() gives no way to pass. */
+static struct {
+	const char **keys;
+	void **values;
+	size_t n;
+} cs;
+
+static void
+collect(const char *key, void *value)
+{
+	cs.keys[cs.n] = key;
+	cs.values[cs.n] = value;
+	++cs.n;
+}
+
+/* Try to place the keys with the hashes h, false if some bucket found no
+ * displacement. */
+static bool
+place(Phmap *ph, const uint64_t *h, const char **keys, void **values)
+{
+	size_t *start = xcalloc(ph->nbuckets + 1, sizeof(*start));
+	size_t *order = xcalloc(ph->n, sizeof(*order));
+	size_t *bybucket = xcalloc(ph->n, sizeof(*bybucket));
+	size_t *slots;
+	size_t i, j, k, b, nb, size, maxsize = 0;
+	uint32_t d;
+	bool ok = true;
+
+	/* Sort the keys by bucket, and the buckets by size, largest
+	 * first, which are the hardest to place. */
+	for (i = 0; i < ph->n; ++i)
+		++start[bucket(ph, h[i]) + 1];
+	for (b = 0; b < ph->nbuckets; ++b) {
+		if (start[b + 1] > maxsize)
+			maxsize = start[b + 1];
+		start[b + 1] += start[b];
+	}
+	for (i = 0; i < ph->n; ++i)
+		bybucket[start[bucket(ph, h[i])]++] = i;
+	for (b = ph->nbuckets; b--; )
+		start[b + 1] = start[b];
+	start[0] = 0;
+	slots = xcalloc(maxsize + 1, sizeof(*slots));
+	/* Counting sort again, slots counting the buckets of each size. */
+	for (b = 0; b < ph->nbuckets; ++b)
+		++slots[start[b + 1] - start[b]];
+	for (k = 0, size = maxsize; size; --size) {
+		nb = slots[size];
+		slots[size] = k;
+		k += nb;
+	}
+	nb = k;
+	for (b = 0; b < ph->nbuckets; ++b) {
+		if ((size = start[b + 1] - start[b]))
+			order[slots[size]++] = b;
+	}
+
+	memset(ph->keys, 0, ph->n * sizeof(*ph->keys));
+	for (k = 0; k < nb; ++k) {
+		b = order[k];
+		if (start[b + 1] - start[b] == 1)
+			break;
+		for (d = 0; d < MAXDISP; ++d) {
+			for (i = start[b]; i < start[b + 1]; ++i) {
+				slots[i - start[b]] = slot(ph, h[bybucket[i]], d);
+				if (ph->keys[slots[i - start[b]]])
+					break;
+				for (j = start[b]; j < i; ++j) {
+					if (slots[j - start[b]] == slots[i - start[b]])
+						break;
+				}
+				if (j < i)
+					break;
+			}
+			if (i == start[b + 1])
+				break;
+		}
+		if (d == MAXDISP) {
+			ok = false;
+			break;
+		}
+		ph->disp[b] = d;
+		for (i = start[b]; i < start[b + 1]; ++i) {
+			ph->keys[slots[i - start[b]]] = keys[bybucket[i]];
+			ph->values[slots[i - start[b]]] = values[bybucket[i]];
+		}
+	}
+	for (i = 0; ok && k < nb; ++k) {
+		b = order[k];
+		while (ph->keys[i])
+			++i;
+		ph->disp[b] = DIRECT | i;
+		ph->keys[i] = keys[bybucket[start[b]]];
+		ph->values[i] = values[bybucket[start[b]]];
+	}
+
+	free(start);
+	free(order);
+	free(bybucket);
+	free(slots);
+	return ok;
+}
+
+Phmap *
+ph_new(Strmap *sm)
+{
+	Phmap *ph = xmalloc(sizeof(*ph));
+	uint64_t *h;
+	size_t i;
+
+	ph->n = sm_size(sm);
+	if (ph->n >= DIRECT)
+		error(EXIT_FAILURE, 0, "too many keys for a perfect hash");
+	ph->nbuckets = ph->n / BUCKETSIZE + 1;
+	ph->disp = xcalloc(ph->nbuckets, sizeof(*ph->disp));
+	ph->keys = xcalloc(ph->n + 1, sizeof(*ph->keys));
+	ph->values = xcalloc(ph->n + 1, sizeof(*ph->values));
+	if (!ph->n)
+		return ph;
+
+	cs.keys = xcalloc(ph->n, sizeof(*cs.keys));
+	cs.values = xcalloc(ph->n, sizeof(*cs.values));
+	cs.n = 0;
+	sm_foreach(sm, collect);
+
+	h = xcalloc(ph->n, sizeof(*h));
+	for (ph->seed = 0; ph->seed < MAXSEEDS; ++ph->seed) {
+		for (i = 0; i < ph->n; ++i)
+			h[i] = hash(cs.keys[i], ph->seed);
+		if (place(ph, h, cs.keys, cs.values))
+			break;
+	}
+
+	free(h);
+	free(cs.keys);
+	free(cs.values);
+	if (ph->seed == MAXSEEDS) {
+		ph_delete(ph);
+		return NULL;
+	}
+	return ph;
+}
+
+void
+ph_delete(Phmap *ph)
+{
+	free(ph->disp);
+	free(ph->keys);
+	free(ph->values);
+	free(ph);
+}
+
+size_t
+ph_memsize(const Phmap *ph)
+{
+	return sizeof(*ph) + ph->nbuckets * sizeof(*ph->disp)
+	       + (ph->n + 1) * (sizeof(*ph->keys) + sizeof(*ph->values));
+}
+
+void *
+ph_get(const Phmap *ph, const char *key)
+{
+	uint64_t h;
+	uint32_t d;
+	size_t i;
+
+	if (!ph->n)
+		return NULL;
+	h = hash(key, ph->seed);
+	d = ph->disp[bucket(ph, h)];
+	i = (d & DIRECT? d & ~DIRECT: slot(ph, h, d));
+	return strcmp(key, ph->keys[i])? NULL: ph->values[i];
+}
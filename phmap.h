@@ -0,0 +1,20 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* "strmap.h" should be included before this header */
+
+/* A read-only map built with a minimal perfect hash of the keys of a
+ * Strmap: a lookup hashes the key once and compares it with the only key
+ * it can be. */
+typedef struct Phmap Phmap;
+
+/* NULL if no perfect hash of the keys was found. */
+Phmap *ph_new(Strmap *sm);
+void ph_delete(Phmap *ph);
+void *ph_get(const Phmap *ph, const char *key);
+/* The bytes taken by ph. */
+size_t ph_memsize(const Phmap *ph);
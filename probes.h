@@ -0,0 +1,53 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* Static tracepoints of the provider unitex.  With USE_SDT defined, which
+ * needs <sys/sdt.h> from SystemTap, they are USDT probes, each a no-op
+ * instruction until a tracer attaches; otherwise they are nothing at all
+ * and don't evaluate their arguments.  Arguments that take work to find
+ * are only worked out if PROBING(name), which reads the semaphore a tracer
+ * sets on attaching.
+ *
+ *   rules__load(nfiles)            rules__loaded(ok, nrules)
+ *   tries__build(tries)            tries__built(tries)
+ *   line__start(reverse)           line__done(reverse)
+ *   rule__hit(text, ntks)          restore(text, ntks)
+ *   output(size)
+ *
+ * rules__* bracket loading rules files, tries__* building the tries in
+ * needtries() and line__* converting a line.  rule__hit() is a rule
+ * concealing ntks tokens as text, restore() ntks tokens restored to text,
+ * and output() the size in bytes of a line puttks() has written. */
+
+#ifdef USE_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBES(X) \
+	X(rules__load) X(rules__loaded) X(tries__build) X(tries__built) \
+	X(line__start) X(line__done) X(rule__hit) X(restore) X(output)
+
+#define PROBE_SEMAPHORE(name) unitex_##name##_semaphore
+#define PROBE_DECLARE(name) extern unsigned short PROBE_SEMAPHORE(name);
+PROBES(PROBE_DECLARE)
+
+#define PROBING(name) (PROBE_SEMAPHORE(name) != 0)
+#define PROBE1(name, a) DTRACE_PROBE1(unitex, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(unitex, name, a, b)
+
+#else
+
+#define PROBING(name) 0
+#define PROBE1(name, a) ((void)sizeof(a))
+#define PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+
+#endif
+
+/* The text of tokens as in rules->data, up to an empty one, in a static
+ * buffer; long texts are cut short.  Only defined with USE_SDT. */
+const char *probetext(const char *tks);
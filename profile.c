@@ -0,0 +1,397 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+
+#include "misc.h"
+#include "rules.h"
+#include "profile.h"
+
+/* Matches of NLEVELS tokens or more are counted together. */
+#define NLEVELS 16
+
+/* Counts of a rule by its text, the fields joined by a Tab. */
+typedef struct {
+	char *text;
+	unsigned long hits[PF_NDIRS];
+} Folded;
+
+/* The rules bound start at the offsets starts in data, each with
+ * PF_NDIRS counts in hits; of rules laid over a base, the first nbase
+ * start in the data of the base instead.  Counts of rules no longer
+ * bound, or read for rules not bound, are kept in folded by text. */
+struct Profile {
+	const Rules *base;
+	const char *data;
+	size_t nbase;
+	Idxv *starts;
+	unsigned long *hits;
+	unsigned long levels[PF_NDIRS][NLEVELS];
+	Strmap *folded;
+};
+
+static const char *const dirnames[PF_NDIRS] = { "conceal", "restore" };
+
+/* Skip a field in data: tokens each ending with a NUL, then a NUL. */
+static const char *
+skipfield(const char *p)
+{
+	while (*p != NUL)
+		p += strlen(p) + 1;
+	return p + 1;
+}
+
+static const char *
+decodefield(const char *p, Charv *cv)
+{
+	while (*p != NUL) {
+		do {
+			cv_push(cv, tr(*p));
+		} while (*++p != NUL);
+		++p;
+	}
+	return p + 1;
+}
+
+static const char *
+ruletext(const Profile *pf, size_t r, Charv *cv)
+{
+	const char *p = (r < pf->nbase? pf->base->data: pf->data) + iv_get(pf->starts, r);
+
+	cv_resize(cv, 0);
+	p = decodefield(p, cv);
+	cv_push(cv, '\t');
+	decodefield(p, cv);
+	cv_push(cv, '\0');
+	return cv_getptr(cv, 0);
+}
+
+/* The index of the rule whose fields hold key. */
+static size_t
+ruleof(const Profile *pf, const char *key)
+{
+	bool inb = pf->base && indata(pf->base, key);
+	size_t off = key - (inb? pf->base->data: pf->data);
+	size_t lo = (inb? 0: pf->nbase), hi = (inb? pf->nbase: iv_size(pf->starts)), mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (iv_get(pf->starts, mid) <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static Folded *
+fold(Profile *pf, const char *text)
+{
+	Folded *fd = sm_get(pf->folded, text);
+
+	if (!fd) {
+		fd = xmalloc(sizeof(*fd));
+		fd->text = xmalloc(strlen(text) + 1);
+		strcpy(fd->text, text);
+		memset(fd->hits, 0, sizeof(fd->hits));
+		sm_insert(pf->folded, fd->text, fd);
+	}
+	return fd;
+}
+
+static void
+deletefolded(const char *key, void *value)
+{
+	Folded *fd = value;
+
+	free(fd->text);
+	free(fd);
+}
+
+/* Push the offsets of the rules, which follow a NUL in data. */
+static void
+findstarts(Idxv *starts, const char *data, size_t len)
+{
+	const char *p = data + 1;
+
+	while (p < data + len && *p != NUL) {
+		iv_push(starts, p - data);
+		p = skipfield(skipfield(p));
+	}
+}
+
+/* Index the rules and take over the counts folded for them. */
+static void
+bind(Profile *pf, const Rules *rules)
+{
+	Charv *cv = cv_new();
+	Folded *fd;
+	size_t n, r, d;
+
+	pf->base = rules->base;
+	pf->data = rules->data;
+	pf->starts = iv_new();
+	if (rules->base)
+		findstarts(pf->starts, rules->base->data, rules->base->datalen);
+	pf->nbase = iv_size(pf->starts);
+	findstarts(pf->starts, rules->data, rules->datalen);
+	n = iv_size(pf->starts) * PF_NDIRS;
+	pf->hits = xcalloc(n? n: 1, sizeof(*pf->hits));
+
+	if (sm_size(pf->folded)) {
+		for (r = 0; r < iv_size(pf->starts); ++r) {
+			if (!(fd = sm_get(pf->folded, ruletext(pf, r, cv))))
+				continue;
+			for (d = 0; d < PF_NDIRS; ++d)
+				pf->hits[r * PF_NDIRS + d] += fd->hits[d];
+			sm_set(pf->folded, fd->text, NULL);
+			deletefolded(NULL, fd);
+		}
+	}
+	cv_delete(cv);
+}
+
+static void
+unbind(Profile *pf)
+{
+	Charv *cv = cv_new();
+	Folded *fd;
+	size_t r, d;
+
+	for (r = 0; r < iv_size(pf->starts); ++r) {
+		for (d = 0; d < PF_NDIRS && !pf->hits[r * PF_NDIRS + d]; ++d);
+		if (d == PF_NDIRS)
+			continue;
+		fd = fold(pf, ruletext(pf, r, cv));
+		for (d = 0; d < PF_NDIRS; ++d)
+			fd->hits[d] += pf->hits[r * PF_NDIRS + d];
+	}
+	cv_delete(cv);
+	iv_delete(pf->starts);
+	free(pf->hits);
+}
+
+Profile *
+pf_new(const Rules *rules)
+{
+	Profile *pf = xmalloc(sizeof(*pf));
+
+	memset(pf->levels, 0, sizeof(pf->levels));
+	pf->folded = sm_new();
+	bind(pf, rules);
+	return pf;
+}
+
+void
+pf_delete(Profile *pf)
+{
+	iv_delete(pf->starts);
+	free(pf->hits);
+	sm_foreach(pf->folded, deletefolded);
+	sm_delete(pf->folded);
+	free(pf);
+}
+
+void
+pf_rebind(Profile *pf, const Rules *rules)
+{
+	unbind(pf);
+	bind(pf, rules);
+}
+
+void
+pf_hit(Profile *pf, int dir, const char *key, size_t ntks)
+{
+	++pf->hits[ruleof(pf, key) * PF_NDIRS + dir];
+	++pf->levels[dir][(ntks < NLEVELS? ntks: NLEVELS) - 1];
+}
+
+unsigned long
+pf_hits(const Profile *pf, int dir, const char *key)
+{
+	return pf->hits[ruleof(pf, key) * PF_NDIRS + dir];
+}
+
+/* A line of rules to write; the text of a bound rule is a copy. */
+typedef struct {
+	unsigned long hits;
+	int dir;
+	char *text;
+	bool copy;
+} Entry;
+
+/* State of collect(), which sm_foreach() gives no way to pass. */
+static struct {
+	Entry *entries;
+	size_t n;
+} cs;
+
+static void
+collect(const char *key, void *value)
+{
+	const Folded *fd = value;
+	int d;
+
+	for (d = 0; d < PF_NDIRS; ++d) {
+		if (!fd->hits[d])
+			continue;
+		cs.entries[cs.n].hits = fd->hits[d];
+		cs.entries[cs.n].dir = d;
+		cs.entries[cs.n].text = fd->text;
+		cs.entries[cs.n].copy = false;
+		++cs.n;
+	}
+}
+
+static int
+byhits(const void *a, const void *b)
+{
+	const Entry *x = a, *y = b;
+
+	if (x->hits != y->hits)
+		return (x->hits < y->hits) - (x->hits > y->hits);
+	if (x->dir != y->dir)
+		return x->dir - y->dir;
+	return strcmp(x->text, y->text);
+}
+
+bool
+pf_write(const Profile *pf, FILE *f)
+{
+	Charv *cv = cv_new();
+	size_t n = iv_size(pf->starts), r, k;
+	int d;
+
+	fputs("# unitex rule profile\n"
+	      "# level\tdirection\ttokens\thits\n", f);
+	for (d = 0; d < PF_NDIRS; ++d) {
+		for (k = 0; k < NLEVELS; ++k) {
+			if (pf->levels[d][k])
+				fprintf(f, "level\t%s\t%zu%s\t%lu\n", dirnames[d], k + 1,
+				        k == NLEVELS - 1? "+": "", pf->levels[d][k]);
+		}
+	}
+
+	cs.entries = xcalloc((n + sm_size(pf->folded)) * PF_NDIRS + 1, sizeof(*cs.entries));
+	cs.n = 0;
+	for (r = 0; r < n; ++r) {
+		for (d = 0; d < PF_NDIRS; ++d) {
+			if (!pf->hits[r * PF_NDIRS + d])
+				continue;
+			ruletext(pf, r, cv);
+			cs.entries[cs.n].hits = pf->hits[r * PF_NDIRS + d];
+			cs.entries[cs.n].dir = d;
+			cs.entries[cs.n].text = cv_to_block(cv);
+			cs.entries[cs.n].copy = true;
+			cv = cv_new();
+			++cs.n;
+		}
+	}
+	sm_foreach(pf->folded, collect);
+	qsort(cs.entries, cs.n, sizeof(*cs.entries), byhits);
+
+	fputs("# direction\thits\tfirst field\tsecond field\n", f);
+	for (k = 0; k < cs.n; ++k) {
+		fprintf(f, "%s\t%lu\t%s\n", dirnames[cs.entries[k].dir],
+		        cs.entries[k].hits, cs.entries[k].text);
+		if (cs.entries[k].copy)
+			free(cs.entries[k].text);
+	}
+	free(cs.entries);
+	cv_delete(cv);
+	return !ferror(f);
+}
+
+static const Profile *atexitpf;
+static const char *atexitfname;
+
+static void
+writeatexit(void)
+{
+	FILE *f = fopen(atexitfname, "w");
+
+	if (!f || !pf_write(atexitpf, f) || fclose(f) == EOF)
+		error(0, errno, "couldn't write %s", atexitfname);
+}
+
+void
+pf_writeatexit(const Profile *pf, const char *fname)
+{
+	atexitpf = pf;
+	atexitfname = fname;
+	if (atexit(writeatexit))
+		error(EXIT_FAILURE, 0, "atexit failed");
+}
+
+Profile *
+pf_read(const char *fname, const Rules *rules)
+{
+	Profile *pf;
+	FILE *f;
+	char *line = NULL, *p, *e;
+	size_t cap = 0, lnum = 0;
+	ssize_t len;
+	unsigned long hits;
+	int d;
+
+	if (!(f = fopen(fname, "r"))) {
+		error(0, errno, "couldn't open %s", fname);
+		return NULL;
+	}
+	pf = xmalloc(sizeof(*pf));
+	memset(pf->levels, 0, sizeof(pf->levels));
+	pf->folded = sm_new();
+	pf->starts = iv_new();
+	pf->hits = NULL;
+
+	while ((len = getline(&line, &cap, f)) != -1) {
+		++lnum;
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len || *line == '#' || !strncmp(line, "level\t", 6))
+			continue;
+		for (d = 0; d < PF_NDIRS; ++d) {
+			size_t n = strlen(dirnames[d]);
+			if (!strncmp(line, dirnames[d], n) && line[n] == '\t')
+				break;
+		}
+		if (d == PF_NDIRS)
+			goto bad;
+		p = line + strlen(dirnames[d]) + 1;
+		hits = strtoul(p, &e, 10);
+		if (e == p || *e != '\t' || !strchr(e + 1, '\t'))
+			goto bad;
+		fold(pf, e + 1)->hits[d] += hits;
+	}
+	if (ferror(f)) {
+		error(0, errno, "input error during reading %s", fname);
+		goto fail;
+	}
+	free(line);
+	fclose(f);
+
+	iv_delete(pf->starts);
+	bind(pf, rules);
+	return pf;
+
+bad:
+	error_at_line(0, 0, fname, lnum, "malformed profile line");
+fail:
+	free(line);
+	fclose(f);
+	pf_delete(pf);
+	return NULL;
+}
@@ -0,0 +1,43 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" should be included before this header */
+
+/* Counts of the rules hit by direction, conceal being TeX-to-Unicode
+ * conversion, for each rule and for each number of tokens matched, which
+ * is the level of the trie the match ends at.  A profile is bound to the
+ * rules it counts hits of, and rebinding it to the rules that replace them
+ * carries the counts over by the text of the rules.
+ *
+ * The profile is written as lines of Tab-separated fields, first
+ *   level  <direction>  <tokens>  <hits>
+ * and then, the rules hit most first,
+ *   <direction>  <hits>  <first field>  <second field>
+ * and pf_read() reads the counts of rules back from it. */
+enum { PF_CONCEAL, PF_RESTORE, PF_NDIRS };
+
+typedef struct Profile Profile;
+
+Profile *pf_new(const Rules *rules);
+void pf_delete(Profile *pf);
+void pf_rebind(Profile *pf, const Rules *rules);
+
+/* Count a hit of the rule that key, a leaf key of the tries of the bound
+ * rules, belongs to, matching ntks tokens. */
+void pf_hit(Profile *pf, int dir, const char *key, size_t ntks);
+
+/* The hits counted of the rule that key belongs to. */
+unsigned long pf_hits(const Profile *pf, int dir, const char *key);
+
+bool pf_write(const Profile *pf, FILE *f);
+
+/* Write the profile to fname at exit. */
+void pf_writeatexit(const Profile *pf, const char *fname);
+
+/* Read a profile written for rules of the same text, reporting errors
+ * without exiting, in which case NULL is returned. */
+Profile *pf_read(const char *fname, const Rules *rules);
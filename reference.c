@@ -0,0 +1,530 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+
+#include "misc.h"
+#include "rules.h"
+#include "reference.h"
+
+/* The reference engine is a copy of the conversion of unitex before it
+ * was made faster, changed only to use the classes of rules and to build
+ * the tries it needs.  It is what -e diff checks misc.c, restore.c and
+ * convert.c against, so it isn't to be optimized or to share their code;
+ * a fix to the conversion goes into both. */
+
+typedef struct {
+	size_t span;
+	const char *cchar;
+} CChar;
+
+static bool
+refreadutf8tail(Charv *cv, unsigned char c, FILE *f)
+{
+	int n;
+
+	assert(c >= 0x80);
+	if (c < 0xc0) {
+		return false;
+	} else if (c < 0xe0) {
+		n = 1;
+	} else if (c < 0xf0) {
+		n = 2;
+	} else if (c < 0xf8) {
+		n = 3;
+	} else {
+		return false;
+	}
+
+	do {
+		c = getc(f);
+		if (c == EOF || (c & 0xc0) != 0x80) {
+			ungetc(c, f);
+			return false;
+		}
+		cv_push(cv, tr(c));
+	} while (--n);
+
+	return true;
+}
+
+static size_t
+refreadtk(Charv *cv, FILE *f)
+{
+	size_t ret;
+	int c;
+
+	while (isblank(c = getc(f)))
+		cv_push(cv, tr(c));
+
+	ret = cv_size(cv);
+
+	if (c == EOF) {
+		cv_push(cv, EOFBYTE);
+	} else {
+		if (c == '\\') {
+			cv_push(cv, tr(c));
+			c = getc(f);
+			if (isalpha(c)) {
+				do {
+					cv_push(cv, tr(c));
+				} while (isalpha(c = getc(f)));
+				ungetc(c, f);
+			} else if (c == '\n') {
+				ungetc(c, f);
+			} else {
+				cv_push(cv, tr(c));
+				if (c >= 0x80 && !refreadutf8tail(cv, c, f))
+					cv_insert(cv, ret, ILSEQ);
+			}
+		} else {
+			cv_push(cv, tr(c));
+			if (c >= 0x80 && !refreadutf8tail(cv, c, f)) {
+				cv_set(cv, ret, c);
+				cv_insert(cv, ret, ILSEQ);
+			}
+		}
+	}
+	cv_push(cv, NUL);
+
+	return ret;
+}
+
+static size_t
+gettk(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+{
+	size_t i = iv_size(ib)? iv_pop(ib): refreadtk(cv, f);
+	iv_push(iv, i);
+	return i;
+}
+
+static size_t
+peektk(Charv *cv, Idxv *ib, FILE *f)
+{
+	if (iv_size(ib)) {
+		return iv_top(ib);
+	} else {
+		size_t i = refreadtk(cv, f);
+		iv_push(ib, i);
+		return i;
+	}
+}
+
+static size_t
+getrestoredtk(const Strmap *invbr, uint64_t classes, Charv *cv, Idxv *iv, Idxv *ib,
+              FILE *f, bool *p_did_restore)
+{
+	size_t iifirst, iilast;
+	Node *nd;
+	size_t i, j, ii;
+	const char *p, *key, *key2;
+	size_t ret = gettk(cv, iv, ib, f);
+	char c;
+
+	c = cv_get(cv, ret);
+	if (((unsigned char)tr(c) < 0x80
+	     && (c == tr('\n')
+	         || (unsigned char)tr(cv_get(cv, peektk(cv, ib, f))) < 0x80
+	        )
+	    ) || !(nd = sm_get(invbr, cv_getptr(cv, ret)))
+	   ) {
+		*p_did_restore = false;
+		return ret;
+	}
+
+	iilast = iv_size(iv);
+	iifirst = iilast - 1;
+	key = nd_key(nd, classes);
+
+	if (nd->br) {
+		Node *nd2 = nd;
+		do {
+			i = gettk(cv, iv, ib, f);
+			nd2 = sm_get(nd2->br, cv_getptr(cv, i));
+			if (!nd2) break;
+			if ((key2 = nd_key(nd2, classes))) {
+				key = key2;
+				iilast = iv_size(iv);
+			}
+		} while (nd2->br);
+
+		while (iv_size(iv) > iilast)
+			iv_push(ib, iv_pop(iv));
+	}
+	if (!key) {
+		*p_did_restore = false;
+		return ret;
+	}
+
+	ii = iifirst;
+	do {
+		i = iv_get(iv, ii) - 1;
+		if (cv_get(cv, i) != NUL) {
+			for (j = i; cv_get(cv, j - 1) != NUL; --j);
+			do {
+				cv_push(cv, cv_get(cv, j));
+			} while (j++ != i);
+		}
+	} while (++ii < iilast);
+	iv_erasen(iv, iifirst, iilast - iifirst);
+
+	p = key;
+	while (isblank(tr(*p))) cv_push(cv, *p++);
+	iv_push(iv, ret = cv_size(cv));
+	for (;;) {
+		do cv_push(cv, *p); while (*p++ != NUL);
+		if (*p == NUL) break;
+		while (isblank(tr(*p))) cv_push(cv, *p++);
+		iv_push(iv, cv_size(cv));
+	}
+
+	*p_did_restore = true;
+	return ret;
+}
+
+static bool
+getrestgrp(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+{
+	size_t depth = 1;
+	size_t tk_i;
+	char c;
+
+	assert(cv_get(cv, iv_top(iv)) == tr('{'));
+
+	for (;;) {
+		tk_i = gettk(cv, iv, ib, f);
+		c = cv_get(cv, tk_i);
+		if (c == tr('{')) {
+			++depth;
+		} else if (c == tr('}')) {
+			if (!--depth) return true;
+		} else if (c == tr('\n') || c == EOFBYTE) {
+			return false;
+		}
+	}
+}
+
+static bool
+getrestss(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+{
+	assert(cv_get(cv, iv_top(iv)) == tr('_') || cv_get(cv, iv_top(iv)) == tr('^'));
+
+	size_t tk_i = gettk(cv, iv, ib, f);
+	char c = cv_get(cv, tk_i);
+
+	if (c == tr('{')) {
+		return getrestgrp(cv, iv, ib, f);
+	} else if (c == tr('\\')) {
+		for (;;) {
+			tk_i = peektk(cv, ib, f);
+			if (cv_get(cv, tk_i) != tr('{') || cv_get(cv, tk_i - 1) != NUL)
+				break;
+			iv_push(iv, iv_pop(ib));
+			if (!getrestgrp(cv, iv, ib, f))
+				return false;
+		}
+	} else if (c == tr('\n') || c == EOFBYTE) {
+		return false;
+	}
+
+	return true;
+}
+
+static void
+getrestoredline(const Strmap *invbr, uint64_t classes, Charv *cv, Idxv *iv, Idxv *ib,
+                FILE *f)
+{
+	bool did_restore;
+	size_t tk_i, tk_ii;
+	size_t ssleader_i, ssleader_ii;
+	bool ssended;
+	size_t ii, jj, kk;
+	size_t i, j;
+	char c;
+
+	assert(cv_size(cv) == 0);
+	assert(iv_size(iv) == 0);
+	cv_push(cv, NUL);
+
+	for (;;) {
+		tk_ii = iv_size(iv);
+		tk_i = getrestoredtk(invbr, classes, cv, iv, ib, f, &did_restore);
+		c = cv_get(cv, tk_i);
+
+		assert(tk_i == iv_get(iv, tk_ii));
+
+		if (!did_restore) {
+			if (c == tr('\n') || c == EOFBYTE)
+				return;
+		} else if (cv_get(cv, i = iv_top(iv)) == tr('\\')
+		           && isalpha(tr(cv_get(cv, i + 1)))
+		           && isalpha(tr(cv_get(cv, i = peektk(cv, ib, f))))
+		           && cv_get(cv, i - 1) == NUL) {
+			cv_push(cv, tr(' '));
+			iv_set(ib, iv_size(ib) - 1, cv_size(cv));
+			do {
+				cv_push(cv, c = cv_get(cv, i++));
+			} while (c != NUL);
+		}
+
+		if (c == tr('_') || c == tr('^')) {
+			ssleader_ii = tk_ii;
+			ssleader_i = tk_i;
+			ssended = false;
+		} else {
+			continue;
+		}
+
+		for (;;) {
+			if (!ssended && !did_restore) {
+				getrestoredtk(invbr, classes, cv, iv, ib, f, &did_restore);
+				if (!did_restore) {
+					while (iv_size(iv) > tk_ii + 1)
+						iv_push(ib, iv_pop(iv));
+					if (!getrestss(cv, iv, ib, f))
+						ssended = true;
+				}
+			}
+
+			if (ssended) {
+				if (tk_ii != ssleader_ii
+				    && cv_get(cv, iv_get(iv, tk_ii - 1)) != tr('}')
+				    && cv_get(cv, iv_get(iv, ssleader_ii + 1)) == tr('{')) {
+					while (iv_size(iv) > tk_ii)
+						iv_push(ib, iv_pop(iv));
+					iv_push(ib, cv_size(cv));
+					cv_push(cv, tr('}'));
+					cv_push(cv, NUL);
+				}
+				while (iv_size(iv) > ssleader_ii + 1)
+					iv_push(ib, iv_pop(iv));
+				break;
+			}
+
+			assert(tk_i == iv_get(iv, tk_ii));
+			assert(cv_get(cv, tk_i) == cv_get(cv, ssleader_i));
+
+			if (tk_ii != ssleader_ii) {
+				ii = tk_ii - 1;
+				if (cv_get(cv, iv_get(iv, ii)) != tr('}')) ++ii;
+				jj = tk_ii + 1;
+				if (cv_get(cv, iv_get(iv, jj)) == tr('{')) ++jj;
+
+				assert(ii > ssleader_ii);
+				assert(jj < iv_size(iv));
+
+				/* Note: Beware that pointers if used may be
+				 * invalidated by vector operations. */
+				kk = ii;
+				do {
+					i = iv_get(iv, kk) - 1;
+					if (cv_get(cv, i) != NUL) {
+						for (j = i; cv_get(cv, j - 1) != NUL; --j);
+						do {
+							cv_push(cv, cv_get(cv, j));
+						} while (j++ != i);
+					}
+				} while (++kk <= jj);
+
+				if (cv_top(cv) == NUL
+				    && isalpha(tr(cv_get(cv, iv_get(iv, jj))))
+				    && cv_get(cv, i = iv_get(iv, ii - 1)) == tr('\\')
+				    && isalpha(tr(cv_get(cv, i + 1))))
+					cv_push(cv, tr(' '));
+
+				if (cv_top(cv) != NUL) {
+					i = iv_get(iv, jj);
+					iv_set(iv, jj, cv_size(cv));
+					do {
+						cv_push(cv, c = cv_get(cv, i++));
+					} while (c != NUL);
+				}
+
+				/* Note: Be aware of invalidation of indicies. */
+				iv_erasen(iv, ii, jj - ii);
+
+				if (cv_get(cv, iv_get(iv, ssleader_ii + 1)) != tr('{')) {
+					iv_insert(iv, ssleader_ii + 1, cv_size(cv));
+					cv_push(cv, tr('{'));
+					cv_push(cv, NUL);
+				}
+			}
+
+			tk_ii = iv_size(iv);
+			tk_i = getrestoredtk(invbr, classes, cv, iv, ib, f, &did_restore);
+
+			if (cv_get(cv, tk_i) != cv_get(cv, ssleader_i))
+				ssended = true;
+		}
+	}
+}
+
+static size_t
+mark(Node *nd, uint64_t classes, const char *const *tks, CChar *cchars, size_t i)
+{
+	size_t j = i + 1, n = 0;
+	const char *key;
+	for (;;) {
+		if ((key = nd_key(nd, classes))) {
+			n = j - i;
+			cchars[i].cchar = key;
+		}
+		if (!nd->br || !(nd = sm_get(nd->br, tks[j])))
+			break;
+		++j;
+	}
+	cchars[i].span = n;
+	return n;
+}
+
+static CChar *
+conceal(const Rules *r, uint64_t classes, const char **tks, size_t ntks)
+{
+	CChar *cchars = xcalloc(ntks, sizeof(*cchars));
+	size_t i, j, n;
+	Node *nd;
+	const Strmap *ssbr;
+	char c;
+	for (i = 0; i < ntks; ) {
+		assert(i < ntks);
+		c = *tks[i];
+		if (r->test_rtbr_initial[(unsigned char)c]) {
+			if ((nd = sm_get(r->rtbr, tks[i]))
+			    && (n = mark(nd, classes, tks, cchars, i))
+			   ) {
+				i += n;
+				continue;
+			}
+			if ((c == tr('_') || c == tr('^')) && *tks[i + 1] == tr('{')) {
+				ssbr = (c == tr('_')? r->subsbr: r->supsbr);
+				i = j = i + 2;
+				for (;;) {
+					if ((nd = sm_get(ssbr, tks[i]))
+					    && (n = mark(nd, classes, tks, cchars, i))) {
+						i += n;
+						if (*tks[i] == tr('}')) {
+							cchars[j - 2] = (CChar){ .span = 2, .cchar = "" };
+							cchars[i++] = (CChar){ .span = 1, .cchar = "" };
+							break;
+						}
+					} else {
+						cchars[j - 2].span = 0;
+						cchars[j - 1].span = 0;
+						i = j;
+						break;
+					}
+				}
+				continue;
+			}
+		}
+
+		cchars[i].span = 0;
+		++i;
+	}
+	return cchars;
+}
+
+static void
+puttks(Charv *out, const char *const *tks, const CChar *cchars)
+{
+	const char *s, *t;
+	char c;
+	size_t i;
+
+	for (i = 0; ; ) {
+		s = tks[i];
+		if (s[-1] != NUL) {
+			for (t = s - 1; t[-1] != NUL; --t);
+			do {
+				cv_push(out, tr(*t++));
+			} while (t != s);
+		}
+		if (cchars && cchars[i].span) {
+			s = cchars[i].cchar;
+			while ((c = *s++) != NUL) {
+				do {
+					cv_push(out, tr(c));
+				} while ((c = *s++) != NUL);
+			}
+			i += cchars[i].span;
+		} else {
+			c = *s++;
+			if (c == tr('\n')) {
+				cv_push(out, '\n');
+				return;
+			} else if (c == EOFBYTE) {
+				return;
+			} else if (c == ILSEQ) {
+				while ((c = *s++) != NUL)
+					cv_push(out, c);
+			} else {
+				while (c != NUL) {
+					cv_push(out, tr(c));
+					c = *s++;
+				}
+			}
+			++i;
+		}
+	}
+}
+
+void
+refconvertline(Rules *rules, bool reverse, uint64_t classes, Charv *cv, Idxv *iv,
+               Idxv *ib, FILE *f, Charv *out)
+{
+	bool doconceal;
+	const char **tks;
+	size_t ntks, j;
+	CChar *cchars;
+
+	if (reverse) {
+		doconceal = false;
+	} else {
+		char c = getc(f);
+		if (c == '\x03') {
+			doconceal = false;
+		} else {
+			ungetc(c, f);
+			doconceal = true;
+		}
+	}
+	needtries(rules, doconceal? ALLTRIES: INVTRIES);
+
+	getrestoredline(rules->invbr, classes, cv, iv, ib, f);
+	if (ferror(f))
+		goto out;
+
+	assert(cv_get(cv, iv_top(iv)) == tr('\n') || cv_get(cv, iv_top(iv)) == EOFBYTE);
+
+	ntks = iv_size(iv);
+	tks = xcalloc(ntks, sizeof(*tks));
+	for (j = ntks; j--; )
+		tks[j] = cv_getptr(cv, iv_get(iv, j));
+
+	if (doconceal)
+		cchars = conceal(rules, classes, (const char**)tks, ntks);
+	else
+		cchars = NULL;
+
+	puttks(out, tks, cchars);
+
+	free(cchars);
+	free(tks);
+
+out:
+	cv_resize(cv, 0);
+	iv_resize(iv, 0);
+}
@@ -0,0 +1,16 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" should be included before this header */
+
+/* Convert a line from f into out with the reference engine: the
+ * tokenizer, restoration and concealment of unitex as they were before
+ * they were made faster, kept apart from those of convertline() for -e
+ * to check against.  Only the rules of a class in classes are used.  cv,
+ * iv and ib are for its use, cv and iv being empty between lines. */
+void refconvertline(Rules *rules, bool reverse, uint64_t classes, Charv *cv, Idxv *iv,
+                    Idxv *ib, FILE *f, Charv *out);
@@ -8,50 +8,187 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "strmap.h"
 #include "vec.h"
+#include "phmap.h"
 
 #include "misc.h"
+#include "rules.h"
 #include "restore.h"
+#include "profile.h"
+#include "probes.h"
+
+/* Brace balances of the tokens pushed back to ib, worked out as they are
+ * needed and kept for the bottom lk.valid tokens, which pops lower: for
+ * each, the balance from the bottom of ib up to it, offset by BALZERO, and
+ * one more than the position of the nearest token below it with a greater
+ * balance, or 0.  A group whose contents start at a token thus ends just
+ * above that position, which tells in constant time whether a group in ib
+ * is closed, where reading it through again for each enclosing group
+ * would take time quadratic in the depth of nesting.  They are reset for
+ * each line, as is lk.depth, the most tokens in ib, which is at its most
+ * before a pop. */
+#define BALZERO (SIZE_MAX / 2)
+
+static struct {
+	Idxv *info;
+	size_t valid;
+	size_t depth;
+} lk;
+
+static void
+balance(const Charv *cv, const Idxv *ib)
+{
+	size_t n = iv_size(ib), k, bal, below, up;
+	char c;
+
+	if (!lk.info) {
+		lk.info = iv_new();
+		clear_at_exit(lk.info, IV_DELETE);
+	}
+	iv_resize(lk.info, 2 * n);
+	for (k = lk.valid; k < n; ++k) {
+		c = cv_get(cv, iv_get(ib, k));
+		below = (k? iv_get(lk.info, 2 * k - 2): BALZERO);
+		bal = below + (c == tr('{')) - (c == tr('}'));
+		if (!k)
+			up = 0;
+		else if (below > bal)
+			up = k;
+		else if (below == bal)
+			up = iv_get(lk.info, 2 * k - 1);
+		else if ((up = iv_get(lk.info, 2 * k - 1)))
+			up = iv_get(lk.info, 2 * up - 1);
+		iv_set(lk.info, 2 * k, bal);
+		iv_set(lk.info, 2 * k + 1, up);
+	}
+	lk.valid = n;
+}
+
+/* One more than the position in ib of the token after the group whose
+ * contents start at position k, or 0 if the group isn't closed in ib.
+ * balance() should be called first. */
+static size_t
+grpend(size_t k)
+{
+	return iv_get(lk.info, 2 * k + 1);
+}
+
+/* Whether the rest of the line is all in ib. */
+static bool
+lineinib(const Charv *cv, const Idxv *ib)
+{
+	char c;
+
+	if (!iv_size(ib))
+		return false;
+	c = cv_get(cv, iv_get(ib, 0));
+	return c == tr('\n') || c == EOFBYTE;
+}
+
+/* Whether the argument atop ib, a group or a control sequence followed by
+ * groups, is closed in ib and followed by a token that is neither restored
+ * nor the leader, which ends a run of subscripts or superscripts with it. */
+static bool
+endsrun(const Charv *cv, const Idxv *ib, char leader)
+{
+	size_t k = iv_size(ib), i;
+	char c = cv_get(cv, iv_get(ib, k - 1));
+
+	balance(cv, ib);
+	if (c == tr('{')) {
+		if (k < 2 || !(k = grpend(k - 2)))
+			return false;
+	} else if (c == tr('\\')) {
+		--k;
+		if (!k || cv_get(cv, i = iv_get(ib, k - 1)) != tr('{') || cv_get(cv, i - 1) != NUL)
+			return false;
+		do {
+			if (k < 2 || !(k = grpend(k - 2)))
+				return false;
+		} while (k && cv_get(cv, i = iv_get(ib, k - 1)) == tr('{') && cv_get(cv, i - 1) == NUL);
+		if (!k)
+			return false;
+	} else {
+		return false;
+	}
+	c = cv_get(cv, iv_get(ib, --k));
+	return c != leader && (unsigned char)tr(c) < 0x80
+	       && (c == tr('\n') || (k && (unsigned char)tr(cv_get(cv, iv_get(ib, k - 1))) < 0x80));
+}
+
+static size_t
+readrawtk(Charv *cv, Idxv *rt, FILE *f)
+{
+	size_t i = readtk(cv, f);
+	if (rt) iv_push(rt, i);
+	return i;
+}
 
+/* Take the next token from ib, or else read it.  Tokens are popped from
+ * ib nowhere else, so lk is kept up to date here, in line since every
+ * token comes this way. */
 static size_t
-gettk(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+gettk(Charv *cv, Idxv *iv, Idxv *ib, Idxv *rt, FILE *f)
 {
-	size_t i = iv_size(ib)? iv_pop(ib): readtk(cv, f);
+	size_t n = iv_size(ib), i;
+
+	if (n) {
+		if (lk.valid >= n)
+			lk.valid = n - 1;
+		if (lk.depth < n)
+			lk.depth = n;
+		i = iv_pop(ib);
+	} else {
+		i = readrawtk(cv, rt, f);
+	}
 	iv_push(iv, i);
 	return i;
 }
 
 static size_t
-peektk(Charv *cv, Idxv *ib, FILE *f)
+peektk(Charv *cv, Idxv *ib, Idxv *rt, FILE *f)
 {
 	if (iv_size(ib)) {
 		return iv_top(ib);
 	} else {
-		size_t i = readtk(cv, f);
+		size_t i = readrawtk(cv, rt, f);
 		iv_push(ib, i);
 		return i;
 	}
 }
 
+/* Look the token at i up in invroot, or if it is NULL in invbr, building
+ * them on first use. */
+static Node *
+lookup(Rules *rules, const Charv *cv, size_t i)
+{
+	if (!(rules->built & INVTRIES))
+		needtries(rules, INVTRIES);
+	return (rules->invroot? ph_get(rules->invroot, cv_getptr(cv, i)):
+	        sm_get(rules->invbr, cv_getptr(cv, i)));
+}
+
 static size_t
-getrestoredtk(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f, bool *p_did_restore)
+getrestoredtk(Rules *rules, uint64_t classes, Charv *cv, Idxv *iv, Idxv *ib, Idxv *rt,
+              FILE *f, bool *p_did_restore)
 {
 	size_t iifirst, iilast;
 	Node *nd;
 	size_t i, j, ii;
-	const char *p;
-	size_t ret = gettk(cv, iv, ib, f);
+	const char *p, *key, *key2;
+	size_t ret = gettk(cv, iv, ib, rt, f);
 	char c;
 
 	c = cv_get(cv, ret);
 	if (((unsigned char)tr(c) < 0x80
 	     && (c == tr('\n')
-	         || (unsigned char)tr(cv_get(cv, peektk(cv, ib, f))) < 0x80
+	         || (unsigned char)tr(cv_get(cv, peektk(cv, ib, rt, f))) < 0x80
 	        )
-	    ) || !(nd = sm_get(invbr, cv_getptr(cv, ret)))
+	    ) || !(nd = lookup(rules, cv, ret))
 	   ) {
 		*p_did_restore = false;
 		return ret;
@@ -59,26 +196,26 @@ getrestoredtk(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f, bool
 
 	iilast = iv_size(iv);
 	iifirst = iilast - 1;
+	key = nd_key(nd, classes);
 
 	if (nd->br) {
 		Node *nd2 = nd;
 		do {
-			i = gettk(cv, iv, ib, f);
+			i = gettk(cv, iv, ib, rt, f);
 			nd2 = sm_get(nd2->br, cv_getptr(cv, i));
 			if (!nd2) break;
-			if (nd2->key) {
-				nd = nd2;
+			if ((key2 = nd_key(nd2, classes))) {
+				key = key2;
 				iilast = iv_size(iv);
 			}
 		} while (nd2->br);
 
 		while (iv_size(iv) > iilast)
 			iv_push(ib, iv_pop(iv));
-
-		if (!nd->key) {
-			*p_did_restore = false;
-			return ret;
-		}
+	}
+	if (!key) {
+		*p_did_restore = false;
+		return ret;
 	}
 
 	ii = iifirst;
@@ -93,7 +230,7 @@ getrestoredtk(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f, bool
 	} while (++ii < iilast);
 	iv_erasen(iv, iifirst, iilast - iifirst);
 
-	p = nd->key;
+	p = key;
 	while (isblank(tr(*p))) cv_push(cv, *p++);
 	iv_push(iv, ret = cv_size(cv));
 	for (;;) {
@@ -103,12 +240,16 @@ getrestoredtk(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f, bool
 		iv_push(iv, cv_size(cv));
 	}
 
+	if (rules->profile)
+		pf_hit(rules->profile, PF_RESTORE, key, iilast - iifirst);
+	if (PROBING(restore))
+		PROBE2(restore, probetext(key), iilast - iifirst);
 	*p_did_restore = true;
 	return ret;
 }
 
 static bool
-getrestgrp(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+getrestgrp(Charv *cv, Idxv *iv, Idxv *ib, Idxv *rt, FILE *f)
 {
 	size_t depth = 1;
 	size_t tk_i;
@@ -116,8 +257,14 @@ getrestgrp(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
 
 	assert(cv_get(cv, iv_top(iv)) == tr('{'));
 
+	if (lineinib(cv, ib)) {
+		balance(cv, ib);
+		if (!grpend(iv_size(ib) - 1))
+			return false;
+	}
+
 	for (;;) {
-		tk_i = gettk(cv, iv, ib, f);
+		tk_i = gettk(cv, iv, ib, rt, f);
 		c = cv_get(cv, tk_i);
 		if (c == tr('{')) {
 			++depth;
@@ -130,22 +277,22 @@ getrestgrp(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
 }
 
 static bool
-getrestss(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+getrestss(Charv *cv, Idxv *iv, Idxv *ib, Idxv *rt, FILE *f)
 {
 	assert(cv_get(cv, iv_top(iv)) == tr('_') || cv_get(cv, iv_top(iv)) == tr('^'));
 
-	size_t tk_i = gettk(cv, iv, ib, f);
+	size_t tk_i = gettk(cv, iv, ib, rt, f);
 	char c = cv_get(cv, tk_i);
 
 	if (c == tr('{')) {
-		return getrestgrp(cv, iv, ib, f);
+		return getrestgrp(cv, iv, ib, rt, f);
 	} else if (c == tr('\\')) {
 		for (;;) {
-			tk_i = peektk(cv, ib, f);
+			tk_i = peektk(cv, ib, rt, f);
 			if (cv_get(cv, tk_i) != tr('{') || cv_get(cv, tk_i - 1) != NUL)
 				break;
-			iv_push(iv, iv_pop(ib));
-			if (!getrestgrp(cv, iv, ib, f))
+			gettk(cv, iv, ib, rt, f);
+			if (!getrestgrp(cv, iv, ib, rt, f))
 				return false;
 		}
 	} else if (c == tr('\n') || c == EOFBYTE) {
@@ -155,13 +302,14 @@ getrestss(Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
 	return true;
 }
 
-void
-getrestoredline(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
+size_t
+getrestoredline(Rules *rules, uint64_t classes, Charv *cv, Idxv *iv, Idxv *ib, Idxv *rt,
+                FILE *f)
 {
 	bool did_restore;
 	size_t tk_i, tk_ii;
 	size_t ssleader_i, ssleader_ii;
-	bool ssended;
+	bool ssended, arginib;
 	size_t ii, jj, kk;
 	size_t i, j;
 	char c;
@@ -169,20 +317,22 @@ getrestoredline(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
 	assert(cv_size(cv) == 0);
 	assert(iv_size(iv) == 0);
 	cv_push(cv, NUL);
+	lk.valid = 0;
+	lk.depth = 0;
 
 	for (;;) {
 		tk_ii = iv_size(iv);
-		tk_i = getrestoredtk(invbr, cv, iv, ib, f, &did_restore);
+		tk_i = getrestoredtk(rules, classes, cv, iv, ib, rt, f, &did_restore);
 		c = cv_get(cv, tk_i);
 
 		assert(tk_i == iv_get(iv, tk_ii));
 
 		if (!did_restore) {
 			if (c == tr('\n') || c == EOFBYTE)
-				return;
+				return lk.depth;
 		} else if (cv_get(cv, i = iv_top(iv)) == tr('\\')
 		           && isalpha(tr(cv_get(cv, i + 1)))
-		           && isalpha(tr(cv_get(cv, i = peektk(cv, ib, f))))
+		           && isalpha(tr(cv_get(cv, i = peektk(cv, ib, rt, f))))
 		           && cv_get(cv, i - 1) == NUL) {
 			cv_push(cv, tr(' '));
 			iv_set(ib, iv_size(ib) - 1, cv_size(cv));
@@ -195,18 +345,27 @@ getrestoredline(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
 			ssleader_ii = tk_ii;
 			ssleader_i = tk_i;
 			ssended = false;
+			arginib = false;
 		} else {
 			continue;
 		}
 
 		for (;;) {
 			if (!ssended && !did_restore) {
-				getrestoredtk(invbr, cv, iv, ib, f, &did_restore);
+				getrestoredtk(rules, classes, cv, iv, ib, rt, f, &did_restore);
 				if (!did_restore) {
 					while (iv_size(iv) > tk_ii + 1)
 						iv_push(ib, iv_pop(iv));
-					if (!getrestss(cv, iv, ib, f))
+					if (endsrun(cv, ib, cv_get(cv, ssleader_i))) {
+						/* Merging takes only the first token
+						 * of the argument, and of a group in
+						 * braces, the rest is left in ib. */
+						if (cv_get(cv, gettk(cv, iv, ib, rt, f)) == tr('{'))
+							gettk(cv, iv, ib, rt, f);
+						arginib = true;
+					} else if (!getrestss(cv, iv, ib, rt, f)) {
 						ssended = true;
+					}
 				}
 			}
 
@@ -274,8 +433,14 @@ getrestoredline(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f)
 				}
 			}
 
+			if (arginib) {
+				while (iv_size(iv) > ssleader_ii + 1)
+					iv_push(ib, iv_pop(iv));
+				break;
+			}
+
 			tk_ii = iv_size(iv);
-			tk_i = getrestoredtk(invbr, cv, iv, ib, f, &did_restore);
+			tk_i = getrestoredtk(rules, classes, cv, iv, ib, rt, f, &did_restore);
 
 			if (cv_get(cv, tk_i) != cv_get(cv, ssleader_i))
 				ssended = true;
@@ -5,6 +5,12 @@
  *  file. If not, see <http://www.gnu.org/licenses>.
  */
 
-/* <stdio.h> "vec.h" should be included before this header */
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" should be included before this header */
 
-void getrestoredline(const Strmap *invbr, Charv *cv, Idxv *iv, Idxv *ib, FILE *f);
+/* If rt isn't NULL, the index of each token read from f is pushed to it.
+ * Tokens are looked up in the invroot of rules, or in its invbr if there
+ * is no invroot, which are built on first use, and only rules of a class
+ * in classes are used.  Return the depth of lookahead, the most tokens in
+ * ib at once. */
+size_t getrestoredline(Rules *rules, uint64_t classes, Charv *cv, Idxv *iv, Idxv *ib,
+                       Idxv *rt, FILE *f);
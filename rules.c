@@ -7,7 +7,9 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,9 +17,118 @@
 #include "strmap.h"
 #include "util.h"
 #include "vec.h"
+#include "phmap.h"
 
 #include "misc.h"
 #include "rules.h"
+#include "profile.h"
+#include "probes.h"
+
+const char builtin_rules_name[] = "built-in rules";
+
+struct Rulefilter {
+	size_t field;
+	bool match;
+	regex_t re;
+	Rulefilter *next;
+};
+
+Rulefilter *
+rf_new(Rulefilter *next, const char *arg, bool match)
+{
+	Rulefilter *rf;
+	const char *p;
+	char *pat;
+	size_t n = 0;
+	int err;
+
+	for (p = arg; *p >= '0' && *p <= '9'; ++p)
+		n = 10 * n + (*p - '0');
+	if (p == arg || *p != ',' || !n)
+		error(EXIT_FAILURE, 0, "invalid argument to -%c: %s", match? 'm': 'M', arg);
+	++p;
+
+	rf = xmalloc(sizeof(*rf));
+	rf->field = n;
+	rf->match = match;
+	rf->next = next;
+
+	/* The pattern is matched against the whole field. */
+	pat = xmalloc(strlen(p) + sizeof("^\\(\\)$"));
+	strcat(strcat(strcpy(pat, "^\\("), p), "\\)$");
+	if ((err = regcomp(&rf->re, pat, REG_NOSUB))) {
+		char msg[256];
+		regerror(err, &rf->re, msg, sizeof(msg));
+		error(EXIT_FAILURE, 0, "invalid pattern in %s: %s", arg, msg);
+	}
+	free(pat);
+
+	return rf;
+}
+
+void
+rf_delete(Rulefilter *rf)
+{
+	Rulefilter *next;
+
+	for (; rf; rf = next) {
+		next = rf->next;
+		regfree(&rf->re);
+		free(rf);
+	}
+}
+
+/* Decode the bytes [i, j) of cv into text, NUL terminated. */
+static const char *
+cvtext(Charv *text, const Charv *cv, size_t i, size_t j)
+{
+	char c;
+
+	cv_resize(text, 0);
+	for (; i < j; ++i) {
+		if ((c = cv_get(cv, i)) != NUL)
+			cv_push(text, tr(c));
+	}
+	cv_push(text, NUL);
+	return cv_getptr(text, 0);
+}
+
+/* Whether a rule passes the filters, given the start and end of its first
+ * two fields in cv and the rest of its line, Tab-separated, in fields. */
+static bool
+filterrule(const Rulefilter *rf, const Charv *cv, size_t f1, size_t f2,
+           size_t end, const Charv *fields, Charv *text)
+{
+	const char *s, *t;
+	size_t n;
+	bool ok;
+
+	for (; rf; rf = rf->next) {
+		if (rf->field == 1) {
+			s = cvtext(text, cv, f1, f2);
+		} else if (rf->field == 2) {
+			s = cvtext(text, cv, f2, end);
+		} else {
+			s = cv_getptr(fields, 0);
+			for (n = 3; n < rf->field && s; ++n) {
+				if ((s = strchr(s, '\t')))
+					++s;
+			}
+			if (s) {
+				t = strchr(s, '\t');
+				n = (t? t - s: strlen(s));
+				cv_resize(text, 0);
+				while (n--) cv_push(text, *s++);
+				cv_push(text, NUL);
+				s = cv_getptr(text, 0);
+			}
+		}
+		ok = (s && *s && !regexec(&rf->re, s, 0, NULL, 0));
+		if (ok != rf->match)
+			return false;
+	}
+	return true;
+}
 
 static size_t
 gettk(Charv *cv, Idxv *iv, FILE *f)
@@ -27,44 +138,91 @@ gettk(Charv *cv, Idxv *iv, FILE *f)
 	return ret;
 }
 
+FILE *
+openrules(const char *fname)
+{
+	if (fname == builtin_rules_name)
+		return fmemopen((char *)builtin_rules_text, builtin_rules_textlen, "r");
+	return fopen(fname, "r");
+}
+
+/* The class a letter names, or none for another character. */
+static uint64_t
+classof(int c)
+{
+	if (c >= 'a' && c <= 'z')
+		return (uint64_t)1 << (c - 'a');
+	if (c >= 'A' && c <= 'Z')
+		return (uint64_t)1 << (26 + c - 'A');
+	return 0;
+}
+
+const char *
+parseclasses(const char *s, uint64_t *classes)
+{
+	*classes = 0;
+	for (; classof((unsigned char)*s); ++s)
+		*classes |= classof((unsigned char)*s);
+	return s;
+}
+
+/* Read the rules files into a block of tokens, returned in *pdata with
+ * its length in *plen, and return a NULL-delimited array of pointers to
+ * the tokens of each field, the number of rules in *pn and their classes
+ * in *pclasses.  Errors are reported without exiting, NULL being
+ * returned. */
 static const char **
-getrules(const Strv *files)
+getrules(const Strv *files, const Rulefilter *rf, char **pdata, size_t *plen,
+         size_t *pn, uint64_t **pclasses)
 {
 	Charv *cv = cv_new();
 	Idxv *iv = iv_new();
+	Charv *fields = cv_new();
+	Charv *text = cv_new();
 	char *data;
 	char **ret;
-	size_t i;
+	uint64_t *classes = NULL, cls;
+	size_t i, cap = 0;
+	FILE *f = NULL;
 
 	cv_push(cv, NUL);
+	*pn = 0;
 
 	for (i = 0; i < sv_size(files); ++i) {
 		const char *fname = sv_get(files, i);
-		FILE *f = fopen(fname, "r");
 		unsigned int lnum;
 		int c;
 		const unsigned char bom[] = {0xef, 0xbb, 0xbf};
 		int j;
 
-		if (!f) error(EXIT_FAILURE, errno, "couldn't open %s", fname);
+		if (!(f = openrules(fname))) {
+			error(0, errno, "couldn't open %s", fname);
+			goto fail;
+		}
 
 		for (j = 0; j < sizeof(bom); ++j) {
 			if ((c = getc(f)) != bom[j]) {
 				ungetc(c, f);
 				while (j--) {
-					if (ungetc(bom[j], f) == EOF)
-						error(EXIT_FAILURE, 0, "ungetc failed");
+					if (ungetc(bom[j], f) == EOF) {
+						error(0, 0, "ungetc failed");
+						goto fail;
+					}
 				}
 				break;
 			}
 		}
 
-#define BADRULE(...) error_at_line(EXIT_FAILURE, 0, fname, lnum, __VA_ARGS__)
+#define BADRULE(...) do { \
+	error_at_line(0, 0, fname, lnum, __VA_ARGS__); \
+	goto fail; \
+} while (0)
 
 		for (lnum = 1; !feof(f); ++lnum) {
 			size_t tk_i;
 			size_t group_level;
 			size_t ascii, nonascii;
+			size_t cv_f1, cv_f2, iv_f1;
 
 			c = getc(f);
 			if (c == '#') {
@@ -78,6 +236,8 @@ getrules(const Strv *files)
 				BADRULE("missing substituend in the first field");
 			ungetc(c, f);
 
+			cv_f1 = cv_size(cv);
+			iv_f1 = iv_size(iv);
 			group_level = 0;
 			for (;;) {
 				tk_i = gettk(cv, iv, f);
@@ -111,11 +271,24 @@ getrules(const Strv *files)
 				BADRULE("unbalanced curly brace in the substituend");
 			cv_push(cv, NUL);
 			iv_push(iv, -1);
+			cv_f2 = cv_size(cv);
 
 			ascii = nonascii = 0;
+			cls = 0;
+			cv_resize(fields, 0);
 			for (c = getc(f); c != '\n' && c != EOF; c = getc(f)) {
 				if (c == '\t') {
-					for (c = getc(f); c != '\n' && c != EOF; c = getc(f));
+					for (c = getc(f); c != '\n' && c != EOF; c = getc(f)) {
+						if (c == '\t')
+							break;
+						cls |= classof(c);
+						if (rf)
+							cv_push(fields, c);
+					}
+					for (; c != '\n' && c != EOF; c = getc(f)) {
+						if (rf)
+							cv_push(fields, c);
+					}
 					break;
 				}
 				iv_push(iv, cv_size(cv));
@@ -137,22 +310,39 @@ getrules(const Strv *files)
 				else
 					BADRULE("missing character in the second field");
 			}
+			if (rf) {
+				cv_push(fields, NUL);
+				if (!filterrule(rf, cv, cv_f1, cv_f2, cv_size(cv), fields, text)) {
+					cv_resize(cv, cv_f1);
+					iv_resize(iv, iv_f1);
+					continue;
+				}
+			}
 			cv_push(cv, NUL);
 			iv_push(iv, -1);
+			if (*pn == cap) {
+				cap = cap + cap / 2 + 16;
+				classes = xreallocarray(classes, cap, sizeof(*classes));
+			}
+			classes[(*pn)++] = (cls? cls: ALLCLASSES);
 
-			if (ferror(f))
-				error(EXIT_FAILURE, 0, "input error during reading %s", fname);
+			if (ferror(f)) {
+				error(0, 0, "input error during reading %s", fname);
+				goto fail;
+			}
 		}
 #undef BADRULE
 
 		fclose(f);
 	}
+	f = NULL;
 
-	data = cv_to_block(cv);
-	clear_at_exit(data, FREE);
+	cv_delete(fields);
+	cv_delete(text);
 
+	*plen = cv_size(cv);
+	data = cv_to_block(cv);
 	ret = xcalloc(iv_size(iv) + 1, sizeof(char *));
-	clear_at_exit(ret, FREE);
 
 	i = iv_size(iv);
 	ret[i] = NULL;
@@ -163,91 +353,312 @@ getrules(const Strv *files)
 
 	iv_delete(iv);
 
+	*pdata = data;
+	*pclasses = classes;
 	return (const char **)ret;
+
+fail:
+	if (f)
+		fclose(f);
+	free(classes);
+	cv_delete(cv);
+	iv_delete(iv);
+	cv_delete(fields);
+	cv_delete(text);
+	return NULL;
 }
 
-void
-parserules(const Strv *files, Strmap **pinvbr, Strmap **prtbr,
-           Strmap **psubsbr, Strmap **psupsbr, bool *test_rtbr_initial)
-{
-	Strmap *invbr, *rtbr, *subsbr, *supsbr;
-	const char **tks = getrules(files);
-	size_t i, j, k;
-	Node *newnd, *curnd;
-	Strmap *ssbr;
-	char c;
+/* Insert the tokens of a field from tks[j] on into the trie br, the leaf
+ * taking key and classes over those of earlier rules.  If group is true, a closing brace that ends
+ * the field is left out.  *newnd is a spare node, replaced when it gets
+ * used.  If base isn't NULL, br is laid over it, and a node br shares with
+ * it is copied before it is changed. */
+static void
+insertrule(Strmap *br, const Strmap *base, const char *const *tks, size_t j, bool group,
+           const char *key, uint64_t classes, Node **newnd)
+{
+	Node *curnd, *basend;
+
+	for (;;) {
+		basend = (base? sm_get(base, tks[j]): NULL);
+		curnd = sm_insert(br, tks[j], *newnd);
+		if (curnd == *newnd) {
+			*newnd = nd_new();
+		} else if (curnd == basend) {
+			curnd = nd_copy(basend);
+			sm_set(br, tks[j], curnd);
+		}
+		++j;
+		if (!tks[j] || (group && *tks[j] == tr('}') && !tks[j + 1])) {
+			nd_setkey(curnd, key, classes);
+			break;
+		}
+		if (!curnd->br)
+			curnd->br = sm_new();
+		br = curnd->br;
+		base = (basend? basend->br: NULL);
+	}
+}
+
+/* A trie to insert n rules into, laid over base if it isn't NULL. */
+static Strmap *
+newtrie(const Strmap *base, size_t n)
+{
+	Strmap *br = (base? sm_copy(base): sm_new());
 
-	assert(pinvbr && (prtbr || (!psubsbr && !psupsbr)));
+	sm_reserve(br, sm_size(br) + n);
+	return br;
+}
 
-	invbr = *pinvbr = sm_new();
-	rtbr = (prtbr? (*prtbr = sm_new()): NULL);
-	subsbr = (psubsbr? (*psubsbr = sm_new()): NULL);
-	supsbr = (psupsbr? (*psupsbr = sm_new()): NULL);
+/* Build the tries in tries from tks, in one pass over the rules. */
+static void
+buildtries(Rules *rules, unsigned int tries)
+{
+	const char **tks = rules->tks;
+	const Rules *base = rules->base;
+	Node *newnd = nd_new();
+	size_t i, j, k, r, n = rules->nrules - (base? base->nrules: 0);
+	uint64_t cls;
+	char c;
 
-	newnd = nd_new();
+	/* An overlay copies the tries of its base, which must be built. */
+	assert(!base || ((!(tries & INVTRIES) || base->invbr) && (!(tries & RTTRIES) || base->rtbr)
+	                 && (!(tries & SSTRIES) || base->subsbr)));
 
-	j = 0;
-	while (tks[j]) {
+	/* The root of rtbr takes a key from most rules, their first fields
+	 * mostly beginning with distinct control words, and growing it one
+	 * resize at a time would rehash it over and over.  Second fields
+	 * share their first characters much more, so the root of invbr
+	 * grows as it goes. */
+	if (tries & INVTRIES)
+		rules->invbr = newtrie(base? base->invbr: NULL, 0);
+	if (tries & RTTRIES)
+		rules->rtbr = newtrie(base? base->rtbr: NULL, n);
+	if (tries & SSTRIES) {
+		rules->subsbr = newtrie(base? base->subsbr: NULL, 0);
+		rules->supsbr = newtrie(base? base->supsbr: NULL, 0);
+	}
+
+	for (j = r = 0; tks[j]; ++r) {
 		i = j;
-		if (rtbr) {
-			test_rtbr_initial[(unsigned char)*tks[j]] = true;
+		while (tks[++j]);
+		++j;
+		cls = rules->classes[r];
 
-			curnd = sm_insert(rtbr, tks[j++], newnd);
-			for (;;) {
-				if (curnd == newnd)
-					newnd = nd_new();
-				if (!tks[j]) {
-					curnd->key = tks[++j];
-					assert(tks[j]);
-					break;
-				}
-				if (!curnd->br)
-					curnd->br = sm_new();
-				curnd = sm_insert(curnd->br, tks[j++], newnd);
-			}
+		if (tries & RTTRIES)
+			insertrule(rules->rtbr, base? base->rtbr: NULL, tks, i, false, tks[j], cls, &newnd);
 
-			c = *tks[i];
-			if ((c == tr('_') || c == tr('^'))
-			     && (ssbr = (c == tr('_')? subsbr: supsbr))
-			   ) {
-				k = i + 1;
-				if (*tks[k] == tr('{')) ++k;
-				curnd = sm_insert(ssbr, tks[k++], newnd);
-				for (;;) {
-					if (curnd == newnd)
-						newnd = nd_new();
-					if (!tks[k]) {
-						curnd->key = tks[k + 1];
-						break;
-					}
-					if (*tks[k] == tr('}') && !tks[k + 1]) {
-						curnd->key = tks[k + 2];
-						break;
-					}
-					if (!curnd->br)
-						curnd->br = sm_new();
-					curnd = sm_insert(curnd->br, tks[k++], newnd);
-				}
-			}
-		} else {
+		c = *tks[i];
+		if ((tries & SSTRIES) && (c == tr('_') || c == tr('^'))) {
+			k = i + 1;
+			if (*tks[k] == tr('{')) ++k;
+			if (c == tr('_'))
+				insertrule(rules->subsbr, base? base->subsbr: NULL, tks, k, true, tks[j], cls, &newnd);
+			else
+				insertrule(rules->supsbr, base? base->supsbr: NULL, tks, k, true, tks[j], cls, &newnd);
+		}
+
+		if (tries & INVTRIES)
+			insertrule(rules->invbr, base? base->invbr: NULL, tks, j, false, tks[i], cls, &newnd);
+		while (tks[j++]);
+	}
+
+	nd_delete(newnd);
+}
+
+void
+needtries(Rules *rules, unsigned int tries)
+{
+	unsigned int build = 0;
+
+	tries &= ~rules->built;
+	if (!tries)
+		return;
+	PROBE1(tries__build, tries);
+
+	if ((tries & INVTRIES) && !rules->invbr)
+		build |= INVTRIES;
+	if ((tries & RTTRIES) && !rules->rtbr)
+		build |= RTTRIES;
+	if ((tries & SSTRIES) && !rules->subsbr)
+		build |= SSTRIES;
+	if (build)
+		buildtries(rules, build);
+
+	if (tries & INVTRIES)
+		rules->invroot = ph_new(rules->invbr);
+	if (tries & RTTRIES)
+		rules->rtroot = ph_new(rules->rtbr);
+	rules->built |= tries;
+	PROBE1(tries__built, tries);
+}
+
+/* Read the rules files into *rules, laid over base if it isn't NULL. */
+static bool
+readover(const Strv *files, const Rulefilter *rf, const Rules *base, bool reverse,
+         Rules *rules)
+{
+	char *data;
+	const char **tks;
+	uint64_t *classes;
+	size_t j, len, n;
+
+	PROBE1(rules__load, sv_size(files));
+
+	if (!(tks = getrules(files, rf, &data, &len, &n, &classes))) {
+		PROBE2(rules__loaded, false, 0);
+		return false;
+	}
+	rules->data = data;
+	rules->datalen = len;
+	rules->tks = tks;
+	rules->classes = classes;
+	rules->nrules = n + (base? base->nrules: 0);
+	rules->isstatic = false;
+	rules->invbr = rules->rtbr = rules->subsbr = rules->supsbr = NULL;
+	rules->invroot = rules->rtroot = NULL;
+	rules->built = 0;
+	rules->profile = NULL;
+	rules->base = base;
+
+	if (base && !reverse)
+		memcpy(rules->test_rtbr_initial, base->test_rtbr_initial, sizeof(rules->test_rtbr_initial));
+	else
+		memset(rules->test_rtbr_initial, 0, sizeof(rules->test_rtbr_initial));
+	if (!reverse) {
+		for (j = 0; tks[j]; ) {
+			rules->test_rtbr_initial[(unsigned char)*tks[j]] = true;
+			while (tks[++j]);
 			while (tks[++j]);
 			++j;
 		}
+	}
+	PROBE2(rules__loaded, true, rules->nrules);
+	return true;
+}
 
-		curnd = sm_insert(invbr, tks[j++], newnd);
-		for (;;) {
-			if (curnd == newnd)
-				newnd = nd_new();
-			if (!tks[j]) {
-				curnd->key = tks[i];
-				++j;
-				break;
-			}
-			if (!curnd->br)
-				curnd->br = sm_new();
-			curnd = sm_insert(curnd->br, tks[j++], newnd);
+/* The built-in rules are already in tries as a whole.  Rules files read
+ * after them are only read into an overlay of them. */
+bool
+loadrules(const Strv *files, const Rulefilter *rf, bool reverse, Rules *rules)
+{
+	Strv *overlay;
+	size_t j;
+	bool ok;
+
+	if (sv_size(files) && sv_get(files, 0) == builtin_rules_name && !rf
+	    && builtin_rules.invbr) {
+		if (sv_size(files) == 1) {
+			PROBE1(rules__load, 1);
+			*rules = builtin_rules;
+			PROBE2(rules__loaded, true, rules->nrules);
+			return true;
 		}
+		overlay = sv_new();
+		for (j = 1; j < sv_size(files); ++j)
+			sv_push(overlay, sv_get(files, j));
+		ok = readover(overlay, rf, &builtin_rules, reverse, rules);
+		sv_delete(overlay);
+		return ok;
 	}
+	return readover(files, rf, NULL, reverse, rules);
+}
 
-	nd_delete(newnd);
+bool
+layerrules(const Strv *files, const Rulefilter *rf, const Rules *base, bool reverse,
+           Rules *rules)
+{
+	return readover(files, rf, base, reverse, rules);
+}
+
+void
+parserules(const Strv *files, const Rulefilter *rf, bool reverse, Rules *rules)
+{
+	if (!loadrules(files, rf, reverse, rules))
+		exit(EXIT_FAILURE);
+}
+
+bool
+reloadrules(const Strv *files, const Rulefilter *rf, bool reverse, Rules *rules)
+{
+	Rules fresh;
+
+	if (!loadrules(files, rf, reverse, &fresh))
+		return false;
+	/* The tries in use would be built for the next line anyway. */
+	needtries(&fresh, rules->built);
+	if ((fresh.profile = rules->profile))
+		pf_rebind(fresh.profile, &fresh);
+	freerules(rules);
+	*rules = fresh;
+	return true;
+}
+
+void
+freerules(Rules *rules)
+{
+	if (rules->invroot)
+		ph_delete(rules->invroot);
+	if (rules->rtroot)
+		ph_delete(rules->rtroot);
+	if (rules->isstatic)
+		return;
+	if (rules->base) {
+		if (rules->invbr)
+			br_deleteover(rules->invbr, rules->base->invbr);
+		if (rules->rtbr)
+			br_deleteover(rules->rtbr, rules->base->rtbr);
+		if (rules->subsbr) {
+			br_deleteover(rules->subsbr, rules->base->subsbr);
+			br_deleteover(rules->supsbr, rules->base->supsbr);
+		}
+	} else {
+		if (rules->invbr)
+			br_delete(rules->invbr);
+		if (rules->rtbr)
+			br_delete(rules->rtbr);
+		if (rules->subsbr) {
+			br_delete(rules->subsbr);
+			br_delete(rules->supsbr);
+		}
+	}
+	free((void *)rules->tks);
+	free(rules->classes);
+	free(rules->data);
+}
+
+size_t
+rulessize(const Rules *rules)
+{
+	const Rules *base = rules->base;
+	size_t size = 0, j;
+
+	if (rules->invroot)
+		size += ph_memsize(rules->invroot);
+	if (rules->rtroot)
+		size += ph_memsize(rules->rtroot);
+	if (rules->isstatic)
+		return size;
+	for (j = 0; rules->tks[j]; ) {
+		while (rules->tks[++j]);
+		while (rules->tks[++j]);
+		++j;
+	}
+	size += rules->datalen + (j + 1) * sizeof(*rules->tks)
+	        + (rules->nrules - (base? base->nrules: 0)) * sizeof(*rules->classes);
+	if (rules->invbr)
+		size += br_sizeover(rules->invbr, base? base->invbr: NULL);
+	if (rules->rtbr)
+		size += br_sizeover(rules->rtbr, base? base->rtbr: NULL);
+	if (rules->subsbr) {
+		size += br_sizeover(rules->subsbr, base? base->subsbr: NULL);
+		size += br_sizeover(rules->supsbr, base? base->supsbr: NULL);
+	}
+	return size;
+}
+
+bool
+indata(const Rules *rules, const char *p)
+{
+	return (uintptr_t)p - (uintptr_t)rules->data < rules->datalen;
 }
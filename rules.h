@@ -5,7 +5,107 @@
  *  file. If not, see <http://www.gnu.org/licenses>.
  */
 
-/* <stdbool.h> "strmap.h" "vec.h" should be included before this header */
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" should be included before this header */
 
-void parserules(const Strv *files, Strmap **pinvbr, Strmap **prtbr,
-                Strmap **psubsbr, Strmap **psupsbr, bool *test_rtbr_initial);
+/* Tries of rules: invbr for Unicode-to-TeX conversion; rtbr, subsbr and
+ * supsbr for TeX-to-Unicode conversion, the latter two for the grouped
+ * subscripts and superscripts, are never needed if parsed for reverse
+ * conversion.  invroot and rtroot index the roots of invbr and rtbr with a
+ * perfect hash, or are NULL if none was found.  The keys point into data,
+ * which tks indexes, nrules rules in all, unless isstatic is true for the
+ * built-in rules.
+ *
+ * Loading only reads the rules into tks, as most runs need few of the
+ * tries, e.g. none for ASCII text in reverse; built has a bit set for
+ * each of INVTRIES, RTTRIES and SSTRIES built with needtries(), the first
+ * two along with their perfect hashes, and the others are NULL until then.
+ * test_rtbr_initial is set up when loading.  If profile isn't NULL, the
+ * rules hit are counted in it (see profile.h).
+ *
+ * Each letter in the third field of a rule names a class of it, as those
+ * of vim's g:tex_conceal do, and the classes of a rule, ALLCLASSES for one
+ * of none, are in classes in the order of tks and in the node of each
+ * trie it ends at, so that conversion can use only the rules of some.
+ *
+ * If base isn't NULL, the rules are an overlay read after those of base,
+ * e.g. the built-in rules: data, tks, classes and the count in nrules
+ * less base's are of the overlay alone, and each trie is a copy of that
+ * of base in which the nodes on the paths of the overlay are copies too,
+ * so the keys of the tries point into either data.  The rest of the nodes
+ * are shared. */
+enum { INVTRIES = 1, RTTRIES = 2, SSTRIES = 4, ALLTRIES = 7 };
+#define ALLCLASSES UINT64_MAX
+
+typedef struct Rules {
+	Strmap *invbr;
+	Strmap *rtbr;
+	Strmap *subsbr;
+	Strmap *supsbr;
+	bool test_rtbr_initial[256];
+	struct Phmap *invroot;
+	struct Phmap *rtroot;
+	unsigned int built;
+	char *data;
+	size_t datalen;
+	const char **tks;
+	uint64_t *classes;
+	size_t nrules;
+	bool isstatic;
+	struct Profile *profile;
+	const struct Rules *base;
+} Rules;
+
+/* The rules built into the executable, from the text of the rules files
+ * it was built with (see gencsource()), with builtin_rules_textlen zero
+ * if there are none.  builtin_rules_name, as the name of a rules file,
+ * stands for them, and compares equal only as a pointer. */
+extern const Rules builtin_rules;
+extern const char builtin_rules_text[];
+extern const size_t builtin_rules_textlen;
+extern const char builtin_rules_name[];
+
+/* Filters selecting rules whose numbered Tab-separated field matches, or
+ * if match is false doesn't match, a basic regular expression.  arg is
+ * the field number and the pattern separated by a comma. */
+typedef struct Rulefilter Rulefilter;
+
+Rulefilter *rf_new(Rulefilter *next, const char *arg, bool match);
+void rf_delete(Rulefilter *rf);
+
+/* Parse the rules files into *rules, exiting on error. */
+void parserules(const Strv *files, const Rulefilter *rf, bool reverse, Rules *rules);
+
+/* Parse the rules files into *rules, reporting errors without exiting.
+ * Return false on error. */
+bool loadrules(const Strv *files, const Rulefilter *rf, bool reverse, Rules *rules);
+
+/* Read the rules files into *rules as an overlay of base, whose tries
+ * must be built for those the overlay will need, reporting errors without
+ * exiting.  Return false on error. */
+bool layerrules(const Strv *files, const Rulefilter *rf, const Rules *base, bool reverse,
+                Rules *rules);
+
+/* Replace *rules with a fresh parse of the rules files, with the tries
+ * built in *rules built and its profile rebound.  On error *rules is kept
+ * as it is and false is returned. */
+bool reloadrules(const Strv *files, const Rulefilter *rf, bool reverse, Rules *rules);
+
+/* Build the tries in tries, a set of INVTRIES, RTTRIES and SSTRIES, that
+ * aren't built yet. */
+void needtries(Rules *rules, unsigned int tries);
+
+void freerules(Rules *rules);
+
+/* An estimate of the bytes taken by rules, less what they share with
+ * their base. */
+size_t rulessize(const Rules *rules);
+
+/* Read the letters at the start of s as classes into *classes, and return
+ * the end of them. */
+const char *parseclasses(const char *s, uint64_t *classes);
+
+/* Whether p points into the data of rules. */
+bool indata(const Rules *rules, const char *p);
+
+/* Open a rules file for reading, which may be builtin_rules_name. */
+FILE *openrules(const char *fname);
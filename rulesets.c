@@ -0,0 +1,208 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+
+#include "rules.h"
+#include "profile.h"
+#include "rulesets.h"
+
+/* A rule set, rules coming first as rs_release() is given their address.
+ * size is that of rules, holds the number of holders, and prev and next
+ * link the sets from the most recently used on. */
+typedef struct Ruleset {
+	Rules rules;
+	char *name;
+	size_t size;
+	size_t holds;
+	struct Ruleset *prev;
+	struct Ruleset *next;
+} Ruleset;
+
+/* The sets kept take size bytes in all. */
+struct Rulesets {
+	Rules *base;
+	const Rulefilter *filters;
+	bool reverse;
+	size_t budget;
+	size_t size;
+	Strmap *byname;
+	Ruleset *first;
+	Ruleset *last;
+};
+
+/* Read the files of the set named into *rules laid over base, with its
+ * tries built as those of the base of rs are. */
+static bool
+loadset(const Rulesets *rs, const char *name, const Rules *base, Rules *rules)
+{
+	Strv *files = sv_new();
+	char *s = xmalloc(strlen(name) + 1), *p;
+	bool ok;
+
+	for (p = strtok(strcpy(s, name), ":"); p; p = strtok(NULL, ":"))
+		sv_push(files, p);
+	ok = layerrules(files, rs->filters, base, rs->reverse, rules);
+	sv_delete(files);
+	free(s);
+	if (ok)
+		needtries(rules, rs->base->built);
+	return ok;
+}
+
+static void
+unlink_set(Rulesets *rs, Ruleset *set)
+{
+	*(set->prev? &set->prev->next: &rs->first) = set->next;
+	*(set->next? &set->next->prev: &rs->last) = set->prev;
+}
+
+static void
+push_set(Rulesets *rs, Ruleset *set)
+{
+	set->prev = NULL;
+	set->next = rs->first;
+	*(rs->first? &rs->first->prev: &rs->last) = set;
+	rs->first = set;
+}
+
+static void
+drop(Rulesets *rs, Ruleset *set)
+{
+	unlink_set(rs, set);
+	sm_set(rs->byname, set->name, NULL);
+	rs->size -= set->size;
+	freerules(&set->rules);
+	free(set->name);
+	free(set);
+}
+
+/* Drop idle sets, the least recently used first, until those kept fit in
+ * the budget. */
+static void
+evict(Rulesets *rs)
+{
+	Ruleset *set, *prev;
+
+	for (set = rs->last; set && rs->size > rs->budget; set = prev) {
+		prev = set->prev;
+		if (!set->holds)
+			drop(rs, set);
+	}
+}
+
+Rulesets *
+rs_new(Rules *base, const Rulefilter *rf, bool reverse, size_t budget)
+{
+	Rulesets *rs = xmalloc(sizeof(*rs));
+
+	rs->base = base;
+	rs->filters = rf;
+	rs->reverse = reverse;
+	rs->budget = budget;
+	rs->size = 0;
+	rs->byname = sm_new();
+	rs->first = rs->last = NULL;
+	return rs;
+}
+
+void
+rs_delete(Rulesets *rs)
+{
+	while (rs->first)
+		drop(rs, rs->first);
+	sm_delete(rs->byname);
+	free(rs);
+}
+
+Rules *
+rs_hold(Rulesets *rs, const char *name)
+{
+	Ruleset *set = sm_get(rs->byname, name);
+
+	if (set) {
+		unlink_set(rs, set);
+	} else {
+		set = xmalloc(sizeof(*set));
+		if (!loadset(rs, name, rs->base, &set->rules)) {
+			free(set);
+			return NULL;
+		}
+		set->name = xmalloc(strlen(name) + 1);
+		strcpy(set->name, name);
+		set->size = rulessize(&set->rules);
+		set->holds = 0;
+		sm_insert(rs->byname, set->name, set);
+		rs->size += set->size;
+	}
+	push_set(rs, set);
+	++set->holds;
+	evict(rs);
+	return &set->rules;
+}
+
+void
+rs_release(Rulesets *rs, Rules *rules)
+{
+	Ruleset *set = (Ruleset *)rules;
+
+	--set->holds;
+	evict(rs);
+}
+
+/* The sets are read over the fresh base before anything is replaced, and
+ * the old sets freed before the old base, which they share nodes with. */
+bool
+rs_reload(Rulesets *rs, const Strv *files)
+{
+	Rules fresh;
+	Rules *sets;
+	Ruleset *set;
+	size_t n = 0, k;
+
+	if (!loadrules(files, rs->filters, rs->reverse, &fresh))
+		return false;
+	/* The tries in use would be built for the next line anyway. */
+	needtries(&fresh, rs->base->built);
+	for (set = rs->first; set; set = set->next)
+		++n;
+	sets = xcalloc(n + 1, sizeof(*sets));
+	for (set = rs->first, k = 0; set; set = set->next, ++k) {
+		if (!loadset(rs, set->name, &fresh, sets + k)) {
+			while (k--)
+				freerules(sets + k);
+			freerules(&fresh);
+			free(sets);
+			return false;
+		}
+	}
+
+	for (set = rs->first; set; set = set->next)
+		freerules(&set->rules);
+	if ((fresh.profile = rs->base->profile))
+		pf_rebind(fresh.profile, &fresh);
+	freerules(rs->base);
+	*rs->base = fresh;
+	rs->size = 0;
+	for (set = rs->first, k = 0; set; set = set->next, ++k) {
+		set->rules = sets[k];
+		set->rules.base = rs->base;
+		set->size = rulessize(&set->rules);
+		rs->size += set->size;
+	}
+	free(sets);
+	evict(rs);
+	return true;
+}
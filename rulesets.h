@@ -0,0 +1,34 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" should be included before this header */
+
+/* Rule sets, each the rules of a base laid over with rules files (see
+ * layerrules()) and named by the names of the files joined by colons.  A
+ * set is loaded when first held, and kept while held and afterwards for as
+ * long as the sets kept take no more than a budget of bytes, the idle sets
+ * used least recently being dropped first.  The sets share with the base
+ * all of its tries but the paths their own rules take. */
+typedef struct Rulesets Rulesets;
+
+/* Rule sets over *base, whose tries must be built for those conversion
+ * will need, read with the filters rf for reverse conversion if reverse
+ * is true. */
+Rulesets *rs_new(Rules *base, const Rulefilter *rf, bool reverse, size_t budget);
+void rs_delete(Rulesets *rs);
+
+/* The rules of the set named, loaded unless kept, held until released
+ * with rs_release().  Errors are reported without exiting, NULL being
+ * returned. */
+Rules *rs_hold(Rulesets *rs, const char *name);
+void rs_release(Rulesets *rs, Rules *rules);
+
+/* Replace the base with a fresh parse of the rules files as reloadrules()
+ * does, and each set kept with a fresh read of its files over it, the
+ * rules held included.  On error all are kept as they are and false is
+ * returned. */
+bool rs_reload(Rulesets *rs, const Strv *files);
@@ -0,0 +1,141 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "slowlines.h"
+
+/* The phases of convertline(), in the order of Converter's ns. */
+#define NPHASES 3
+static const char *const phasenames[NPHASES] = { "restore", "conceal", "put" };
+
+typedef struct {
+	const char *fname;
+	size_t lnum;
+	size_t ntks;
+	size_t depth;
+	uint64_t total;
+	uint64_t ns[NPHASES];
+} Slowline;
+
+static bool enabled;
+static uint64_t threshold;
+static struct timespec start;
+static Slowline *top;
+static size_t maxtop, ntop, mintop;
+static unsigned long lines, slow;
+
+static int
+byslowest(const void *a, const void *b)
+{
+	uint64_t x = ((const Slowline *)a)->total;
+	uint64_t y = ((const Slowline *)b)->total;
+
+	return (x < y) - (x > y);
+}
+
+/* Microseconds, rounded up. */
+static unsigned long
+usec(uint64_t v)
+{
+	return (v + 999) / 1000;
+}
+
+static void
+report(void)
+{
+	size_t k, p;
+
+	qsort(top, ntop, sizeof(*top), byslowest);
+	fprintf(stderr, "# unitex slow lines, times in microseconds\n"
+	                "lines\t%lu\tslow\t%lu\tthreshold\t%lu\n"
+	                "file\tline\ttokens\tlookahead\ttotal",
+	        lines, slow, usec(threshold));
+	for (p = 0; p < NPHASES; ++p)
+		fprintf(stderr, "\t%s", phasenames[p]);
+	putc('\n', stderr);
+	for (k = 0; k < ntop; ++k) {
+		fprintf(stderr, "%s\t%zu\t%zu\t%zu\t%lu", top[k].fname, top[k].lnum,
+		        top[k].ntks, top[k].depth, usec(top[k].total));
+		for (p = 0; p < NPHASES; ++p)
+			fprintf(stderr, "\t%lu", usec(top[k].ns[p]));
+		putc('\n', stderr);
+	}
+	free(top);
+}
+
+void
+sl_enable(uint64_t thresholdns, size_t n)
+{
+	enabled = true;
+	threshold = thresholdns;
+	maxtop = n;
+	top = xcalloc(n? n: 1, sizeof(*top));
+	if (atexit(report))
+		error(EXIT_FAILURE, 0, "atexit failed");
+}
+
+bool
+sl_enabled(void)
+{
+	return enabled;
+}
+
+void
+sl_start(void)
+{
+	if (enabled)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+void
+sl_stop(const char *fname, size_t lnum, size_t ntks, size_t depth,
+        const uint64_t *ns)
+{
+	struct timespec end;
+	Slowline *s;
+	uint64_t v;
+	size_t k;
+
+	if (!enabled)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	v = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+	++lines;
+	if (v < threshold)
+		return;
+	++slow;
+
+	/* The fastest kept line, at mintop, makes way once all n are
+	 * taken. */
+	if (ntop < maxtop) {
+		s = &top[ntop++];
+	} else if (maxtop && v > top[mintop].total) {
+		s = &top[mintop];
+	} else {
+		return;
+	}
+	s->fname = fname;
+	s->lnum = lnum;
+	s->ntks = ntks;
+	s->depth = depth;
+	s->total = v;
+	memcpy(s->ns, ns, sizeof(s->ns));
+	if (ntop == maxtop) {
+		for (mintop = 0, k = 1; k < ntop; ++k) {
+			if (top[k].total < top[mintop].total)
+				mintop = k;
+		}
+	}
+}
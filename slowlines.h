@@ -0,0 +1,19 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stddef.h> <stdint.h> should be included before this header */
+
+/* The slowest lines converted, of those taking at least a threshold from
+ * sl_start() to sl_stop(), kept with the time taken by each phase of
+ * convertline() as a Converter set by cvt_time() gives them.  Once
+ * enabled, the n slowest are reported to standard error at exit; until
+ * then the other calls do nothing.  fname has to outlive the report. */
+void sl_enable(uint64_t thresholdns, size_t n);
+bool sl_enabled(void);
+void sl_start(void);
+void sl_stop(const char *fname, size_t lnum, size_t ntks, size_t depth,
+             const uint64_t *ns);
@@ -14,11 +14,7 @@
 
 #define NEW_TABLE_LEN 2
 
-typedef struct StrmapCell {
-	const char *key;
-	void *value;
-	struct StrmapCell *next;
-} Cell;
+typedef struct StrmapCell Cell;
 
 static size_t
 maxpayload(size_t len)
@@ -245,6 +241,29 @@ sm_new()
 	return ret;
 }
 
+Strmap *
+sm_copy(const Strmap *sm)
+{
+	Strmap *ret = xmalloc(sizeof(*ret));
+	const Cell *cell;
+	Cell *copy;
+	size_t i;
+
+	*ret = *sm;
+	ret->cellarr = xcalloc(sm->len, sizeof(*ret->cellarr));
+	for (i = 0; i < sm->len; ++i) {
+		cell = sm->cellarr + i;
+		copy = ret->cellarr + i;
+		*copy = *cell;
+		while (cell->next) {
+			cell = cell->next;
+			copy = copy->next = xmalloc(sizeof(*copy));
+			*copy = *cell;
+		}
+	}
+	return ret;
+}
+
 void
 sm_delete(Strmap *sm)
 {
@@ -258,6 +277,19 @@ sm_size(const Strmap *sm)
 	return sm->payload;
 }
 
+void
+sm_reserve(Strmap *sm, size_t n)
+{
+	size_t newlen = sm->len;
+
+	while (maxpayload(newlen) < n)
+		newlen = expansion_len(newlen);
+	if (newlen != sm->len) {
+		resize(sm, newlen);
+		sm->maxpayload = maxpayload(newlen);
+	}
+}
+
 void *
 sm_insert(Strmap *sm, const char *key, void *value)
 {
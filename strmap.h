@@ -5,6 +5,15 @@
  *  file. If not, see <http://www.gnu.org/licenses>.
  */
 
+/* Exposed so that maps can also be defined statically: cellarr has len
+ * cells, each heading a chain of cells sorted by key, in which are
+ * payload keys in all. */
+struct StrmapCell {
+	const char *key;
+	void *value;
+	struct StrmapCell *next;
+};
+
 typedef struct {
 	struct StrmapCell *cellarr;
 	size_t len;
@@ -15,8 +24,12 @@ typedef struct {
 void sm_init(Strmap *sm);
 void sm_uninit(Strmap *sm);
 Strmap *sm_new(void);
+/* A copy of sm, sharing its keys and values. */
+Strmap *sm_copy(const Strmap *sm);
 void sm_delete(Strmap *sm);
 size_t sm_size(const Strmap *sm);
+/* Make room for n keys in all, so that inserting them won't resize. */
+void sm_reserve(Strmap *sm, size_t n);
 void *sm_insert(Strmap *sm, const char *key, void *value);
 void *sm_set(Strmap *sm, const char *key, void *value);
 void *sm_get(const Strmap *sm, const char *key);
@@ -0,0 +1,95 @@
+#!/bin/sh
+
+# Check that -l, and classes= in -w requests, convert with the last rule
+# read of the classes given when rules of other classes read later have
+# the same field: each way, in the rules of the command line and in a
+# rule set laid over them.
+
+unitex=./unitex
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex]
+options:
+  -x <file>         check the unitex executable (${unitex})
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tmp}"' EXIT
+
+# \foo is ρ of no class, then α of m and β of g; α is \bar of g read
+# last in reverse, and ζ of m is \zeta only before \zed of no class.
+printf '%s\t%s\t%s\n' \
+    '\foo' 'ρ' '' \
+    '\foo' 'α' 'm' \
+    '\foo' 'β' 'g' \
+    '\bar' 'α' 'g' \
+    '\zeta' 'ζ' 'm' \
+    '\zed' 'ζ' '' \
+    '\x' 'χ' 'mg' >"${tmp}/rules.tsv"
+# The set laid over them gives \foo a rule of x and \x one of g.
+printf '%s\t%s\t%s\n' \
+    '\foo' 'δ' 'x' \
+    '\x' 'ξ' 'g' >"${tmp}/set.tsv"
+
+status=0
+
+# Compare the output of converting the input with the options with the
+# expected.
+check() {
+	out="$(printf '%s\n' "$2" | "${unitex}" $1 -u "${tmp}/rules.tsv")"
+	if test "${out}" != "$3" ; then
+		printf 'unitex %s: %s gave %s, not %s\n' "$1" "$2" "${out}" "$3" >&2
+		status=1
+	fi
+}
+
+check '' '\foo \x' 'β χ'
+check '-l m' '\foo \x' 'α χ'
+check '-l g' '\foo \x' 'β χ'
+check '-l mg' '\foo \x' 'β χ'
+check '-l x' '\foo \x' 'ρ \x'
+check '-r' 'α ζ χ' '\bar \zed \x'
+check '-r -l m' 'α ζ χ' '\foo \zed \x'
+check '-r -l g' 'α ζ χ' '\bar \zed \x'
+check '-r -l x' 'α ζ χ' 'α \zed χ'
+
+# The same through -w, with and without the set, and the answers of the
+# requests in order.
+netstring() {
+	printf '%s:%s,' "$(printf '%s' "$1" | wc -c)" "$1"
+}
+{
+	netstring "$(printf 'a 1 1 classes=m\n\\foo \\x\n')"
+	netstring "$(printf 'b 1 1 classes=m rules=%s\n\\foo \\x\n' "${tmp}/set.tsv")"
+	netstring "$(printf 'c 1 1 classes=x rules=%s\n\\foo \\x\n' "${tmp}/set.tsv")"
+	netstring "$(printf 'd 1 1 classes=g rules=%s\n\\foo \\x\n' "${tmp}/set.tsv")"
+} | "${unitex}" -w -u "${tmp}/rules.tsv" | tr ',' '\n' | sed -n 's/^1	//p' >"${tmp}/views"
+printf '%s\n' 'α χ' 'α χ' 'δ \x' 'β ξ' | cmp -s - "${tmp}/views" || {
+	echo "unitex -w: the answers were" >&2
+	cat "${tmp}/views" >&2
+	status=1
+}
+
+if test "${status}" -eq 0 ; then
+	echo 'classes: ok'
+fi
+exit "${status}"
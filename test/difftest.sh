@@ -0,0 +1,194 @@
+#!/bin/sh
+
+# Check the fast engine of unitex against the reference one with -e diff
+# over rounds of random rule sets and generated inputs.  Each round takes
+# a random subset of the rules in a random order, generates lines from
+# their fields and from TeX fragments, mutates them, and converts them
+# both ways, with a random choice of classes every other round.  The
+# rules and input of the first round that fails are kept in a directory.
+
+unitex=./unitex
+rulesfile=rules.tsv
+nrounds=200
+nlines=400
+seed=1
+faildir=difftest.fail
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex] [-u rules-file] [-n rounds] [-l lines] [-s seed] [-k dir]
+options:
+  -x <file>         check the unitex executable (${unitex})
+  -u <file>         take random subsets of the rules file (${rulesfile})
+  -n <n>            run n (${nrounds}) rounds
+  -l <n>            of n (${nlines}) lines each way
+  -s <n>            seed the first round with n (${seed}), the next with n+1 and so on
+  -k <dir>          keep the rules and input of a failed round in dir (${faildir})
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:u:n:l:s:k:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	u)
+		rulesfile="${OPTARG}"
+		;;
+	n)
+		nrounds="${OPTARG}"
+		;;
+	l)
+		nlines="${OPTARG}"
+		;;
+	s)
+		seed="${OPTARG}"
+		;;
+	k)
+		faildir="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tmp}"' EXIT
+
+# Write a random subset of the rules, some moved to the end, which lets
+# them override others.
+genrules() {
+	grep -v '^#' "${rulesfile}" | LC_ALL=C awk -v seed="$1" '
+		BEGIN {
+			srand(seed)
+			keep = 0.2 + rand() * 0.8
+		}
+		rand() < keep {
+			if (rand() < 0.1)
+				moved[nmoved++] = $0
+			else
+				print
+		}
+		END {
+			for (i = 0; i < nmoved; ++i)
+				print moved[i]
+		}'
+}
+
+# Write lines of the fields of the rules, of the field given, mixed with
+# TeX fragments: scripts, groups nested a few levels and stray braces.
+genlines() {
+	LC_ALL=C awk -F '\t' -v seed="$1" -v field="$2" -v nlines="${nlines}" '
+		{ tk[n++] = $field }
+		BEGIN {
+			nfrag = split("_ ^ { } _{ ^{ } x y 2 n \\\\ \\, \\alpha \\mathrm{d} $ a_1 b^2" \
+			              " x^{y^{z}} _{i_{j}} ^{{}} ( ) + - = \\ \\\\{ \\} ~ word", frag, " ")
+		}
+		function piece() {
+			if (rand() < 0.55)
+				return tk[int(rand() * n)]
+			return frag[int(rand() * nfrag) + 1]
+		}
+		END {
+			srand(seed)
+			for (i = 0; i < nlines; ++i) {
+				line = ""
+				len = int(rand() * 24)
+				for (k = 0; k < len; ++k)
+					line = line (rand() < 0.3? " ": "") piece()
+				print line
+			}
+		}' "$3"
+}
+
+# Mutate lines by deleting, inserting and swapping bytes, adding stray
+# braces and blanks, and marking some lines with \x03 to keep them.
+mutate() {
+	LC_ALL=C awk -v seed="$1" '
+		BEGIN {
+			srand(seed)
+			nins = split("{ } _ ^ \\ x 1", ins, " ")
+		}
+		{
+			line = $0
+			nmut = int(rand() * 4)
+			for (k = 0; k < nmut; ++k) {
+				len = length(line)
+				at = int(rand() * (len + 1))
+				r = rand()
+				if (r < 0.25 && len)
+					line = substr(line, 1, at - 1) substr(line, at + 1)
+				else if (r < 0.5)
+					line = substr(line, 1, at) ins[int(rand() * nins) + 1] substr(line, at + 1)
+				else if (r < 0.7 && at + 1 < len)
+					line = substr(line, 1, at) substr(line, at + 2, 1) substr(line, at + 1, 1) \
+					       substr(line, at + 3)
+				else if (r < 0.85)
+					line = substr(line, 1, at) (rand() < 0.5? " ": "\t") substr(line, at + 1)
+				else
+					line = substr(line, 1, at) (rand() < 0.5? "{": "}") substr(line, at + 1)
+			}
+			if (rand() < 0.05)
+				line = "\003" line
+			print line
+		}'
+}
+
+# A random choice of the classes in the third fields of the rules.
+genclasses() {
+	cut -f 3 "$2" | LC_ALL=C awk -v seed="$1" '
+		BEGIN { srand(seed) }
+		{
+			for (i = 1; i <= length($0); ++i) {
+				c = substr($0, i, 1)
+				if (c ~ /[A-Za-z]/)
+					letters[c] = 1
+			}
+		}
+		END {
+			for (c in letters) {
+				if (rand() < 0.5)
+					s = s c
+			}
+			print s
+		}'
+}
+
+round=0
+while test "${round}" -lt "${nrounds}" ; do
+	s=$(( seed + round ))
+	genrules "${s}" >"${tmp}/rules.tsv"
+	genlines "${s}" 1 "${tmp}/rules.tsv" | mutate "${s}" >"${tmp}/in.tex"
+	genlines "${s}" 2 "${tmp}/rules.tsv" | mutate "${s}" >"${tmp}/rin.tex"
+	if test $(( round % 2 )) -eq 1 ; then
+		set -- -l "$(genclasses "${s}" "${tmp}/rules.tsv")"
+	else
+		set --
+	fi
+	for dir in '' -r ; do
+		if test -z "${dir}" ; then
+			input="${tmp}/in.tex"
+		else
+			input="${tmp}/rin.tex"
+		fi
+		if ! "${unitex}" ${dir} "$@" -e diff -u "${tmp}/rules.tsv" "${input}" \
+		     >/dev/null 2>"${tmp}/err" ; then
+			mkdir -p "${faildir}" || exit 1
+			cp "${tmp}/rules.tsv" "${input}" "${faildir}"
+			cat "${tmp}/err" >&2
+			echo "round ${round} (seed ${s}) failed, to reproduce:" >&2
+			echo "${unitex} ${dir} $* -e diff -u ${faildir}/rules.tsv ${faildir}/${input##*/}" >&2
+			exit 1
+		fi
+	done
+	round=$(( round + 1 ))
+done
+
+echo "${nrounds} rounds: no difference"
@@ -0,0 +1,109 @@
+#!/bin/sh
+
+# Check unitex -g as the filter of a scratch git repository: committing
+# converted files must store what unitex -r gives for them, and checking
+# them out again what unitex gives for the stored text.  One of the files
+# spans many packets of the protocol.
+
+unitex=./unitex
+rulesfile=rules.tsv
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex] [-u rules-file]
+options:
+  -x <file>         check the unitex executable (${unitex})
+  -u <file>         convert with the rules file (${rulesfile})
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:u:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	u)
+		rulesfile="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+case "${unitex}" in
+/*) ;;
+*) unitex="${PWD}/${unitex}" ;;
+esac
+case "${rulesfile}" in
+/*) ;;
+*) rulesfile="${PWD}/${rulesfile}" ;;
+esac
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tmp}"' EXIT
+mkdir "${tmp}/src" "${tmp}/repo"
+
+# The sources, small.tex of a few lines and big.tex of about 300 KB,
+# more than four packets of 65516 bytes.
+grep -v '^#' "${rulesfile}" | cut -f 1 | awk -v src="${tmp}/src" '
+	{ cmd[n++] = $0 }
+	function write(f, nlines,    i, k, line) {
+		for (i = 0; i < nlines; ++i) {
+			line = "line " i ":"
+			for (k = 0; k < 6; ++k)
+				line = line " " cmd[int(rand() * n)] " $x^{2}_i$"
+			print line > f
+		}
+		close(f)
+	}
+	END {
+		srand(1)
+		write(src "/small.tex", 5)
+		write(src "/big.tex", 3000)
+	}'
+: >"${tmp}/src/empty.tex"
+
+cd "${tmp}/repo" || exit 1
+git init -q
+git config user.name unitex
+git config user.email unitex@localhost
+git config filter.unitex.process "'${unitex}' -g -u '${rulesfile}'"
+git config filter.unitex.required true
+echo '*.tex filter=unitex' >.gitattributes
+
+for f in small.tex big.tex empty.tex ; do
+	"${unitex}" -u "${rulesfile}" <"${tmp}/src/${f}" >"${f}" || exit 1
+done
+git add .gitattributes *.tex && git commit -q -m 'add files' || exit 1
+
+status=0
+for f in small.tex big.tex empty.tex ; do
+	git cat-file blob "HEAD:${f}" >"${tmp}/${f}.stored"
+	"${unitex}" -r -u "${rulesfile}" <"${f}" >"${tmp}/${f}.clean"
+	if ! cmp -s "${tmp}/${f}.stored" "${tmp}/${f}.clean" ; then
+		echo "${f}: commit stored other than unitex -r gives" >&2
+		status=1
+	fi
+done
+
+rm -f *.tex
+git checkout -- . || exit 1
+for f in small.tex big.tex empty.tex ; do
+	"${unitex}" -u "${rulesfile}" <"${tmp}/${f}.stored" >"${tmp}/${f}.smudge"
+	if ! cmp -s "${f}" "${tmp}/${f}.smudge" ; then
+		echo "${f}: checkout gave other than unitex gives" >&2
+		status=1
+	fi
+done
+
+if test "${status}" -eq 0 ; then
+	echo 'git filter: ok'
+fi
+exit "${status}"
@@ -0,0 +1,78 @@
+#!/bin/sh
+
+# Check the map of -p: one line of it for each line of input, ending in a
+# newline or not, and none for empty input; and the spans of -k, which
+# leave out text converted back to what it was, e.g. Unicode already.
+
+unitex=./unitex
+rulesfile=rules.tsv
+
+usage() {
+	cat << EOF
+usage: $0 [-h] [-x unitex] [-u rules-file]
+options:
+  -x <file>         check the unitex executable (${unitex})
+  -u <file>         convert with the rules file (${rulesfile})
+  -h                print this help and exit
+EOF
+}
+
+while getopts x:u:h opt ; do
+	case "${opt}" in
+	x)
+		unitex="${OPTARG}"
+		;;
+	u)
+		rulesfile="${OPTARG}"
+		;;
+	h|\?)
+		usage
+		if test "${opt}" = 'h' ; then
+			exit 0
+		else
+			exit 1
+		fi
+		;;
+	esac
+done
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -fr "${tmp}"' EXIT
+
+status=0
+
+# Check that the map of the input given with printf has n lines.
+checkmap() {
+	printf "$1" >"${tmp}/in.tex"
+	"${unitex}" -u "${rulesfile}" -p "${tmp}/map" "${tmp}/in.tex" >/dev/null || exit 1
+	n="$(wc -l <"${tmp}/map")"
+	if test "${n}" -ne "$2" ; then
+		printf 'unitex -p: %s mapped in %s lines, not %s\n' "$1" "${n}" "$2" >&2
+		status=1
+	fi
+}
+
+checkmap 'a\n\\alpha x\nc\n' 3
+checkmap 'a\n\\alpha x\nc' 3
+checkmap '\n\n' 2
+checkmap '\\beta' 1
+checkmap '' 0
+
+# Check that -k with the options gives the spans for the input.
+checkspans() {
+	out="$(printf "$2" | "${unitex}" $1 -u "${rulesfile}" -k)"
+	if test "${out}" != "$(printf "$3")" ; then
+		printf 'unitex -k %s: %s gave %s, not %s\n' "$1" "$2" "${out}" "$3" >&2
+		status=1
+	fi
+}
+
+checkspans '' 'αβ x²\n' ''
+checkspans '' 'α\\beta x^2 \\gamma²\n' '1\t2\t7\tβ\n1\t9\t11\t²\n1\t12\t18\tγ'
+checkspans '' '\\alpha\n\\alpha\\alpha αα\n' '1\t0\t6\tα\n2\t0\t12\tαα'
+checkspans '-r' '\\alpha α\n' '1\t7\t9\t\\alpha'
+
+if test "${status}" -eq 0 ; then
+	echo 'positions: ok'
+fi
+exit "${status}"
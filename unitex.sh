@@ -4,6 +4,8 @@ inplace=false
 reverse=false
 rulesfiles=''
 rulesfilter=''
+unitexopts=''
+genopts=''
 styfile=''
 sedscript=''
 
@@ -15,7 +17,7 @@ fi
 
 usage() {
 	cat << EOF
-usage: $0 [-r|-i|-h] [-u rules-files]... [-f rules-files]... [-m n,pattern]... [-M n,pattern]... [-s style-file] [-S sed-script] [input_files...]
+usage: $0 [-r|-i|-h] [-u rules-files]... [-f rules-files]... [-m n,pattern]... [-M n,pattern]... [-l classes] [-s style-file] [-S sed-script] [input_files...]
 options:
   -r                convert in reverse
   -i                change input files in place
@@ -23,13 +25,14 @@ options:
   -f <file>         specify an additional rules file
   -m <n>,<pattern>  use rules whose <n>th field match <pattern>
   -M <n>,<pattern>  use rules whose <n>th field doesn't match <pattern>
-  -s <file>         generated a style file and exit
+  -l <classes>      use only rules of the classes, letters as in their third field, and those of none
+  -s <file>         generate a style file and exit
   -S <file>         generate a sed script and exit
   -h                print this help and exit
 EOF
 }
 
-while getopts s:m:M:S:iru:f:h opt ; do
+while getopts s:m:M:l:S:iru:f:h opt ; do
 	case "${opt}" in
 	r)
 		reverse=true
@@ -39,15 +42,19 @@ while getopts s:m:M:S:iru:f:h opt ; do
 		;;
 	u)
 		rulesfiles="'${OPTARG}'"
+		unitexopts="${unitexopts} -u '${OPTARG}'"
 		;;
 	f)
 		rulesfiles="${rulesfiles} '${OPTARG}'"
+		unitexopts="${unitexopts} -f '${OPTARG}'"
 		;;
 	s)
 		styfile="${OPTARG}"
+		genopts="${genopts} -s '${OPTARG}'"
 		;;
 	S)
 		sedscript="${OPTARG}"
+		genopts="${genopts} -S '${OPTARG}'"
 		;;
 	m|M)
 		if echo "${OPTARG}" | grep -q '^[1-9][0-9]*,.*$' ; then
@@ -57,12 +64,25 @@ while getopts s:m:M:S:iru:f:h opt ; do
 			echo "invalid argument to -m: ${OPTARG}" >&2
 			exit 1
 		fi
+		unitexopts="${unitexopts} -${opt} '${OPTARG}'"
 		if test "${opt}" = 'm'; then
 			rulesfilter="${rulesfilter} | grep '${pat}'"
 		else
 			rulesfilter="${rulesfilter} | grep -v '${pat}'"
 		fi
 		;;
+	l)
+		if ! echo "${OPTARG}" | grep -q '^[A-Za-z]*$' ; then
+			echo "invalid argument to -l: ${OPTARG}" >&2
+			exit 1
+		fi
+		unitexopts="${unitexopts} -l '${OPTARG}'"
+		pat=$( printf '^[^\t]\\+\t[^\t]\\+\\(\t[^\tA-Za-z]*\\(\t.*\\)\\?\\)\\?$' )
+		if test -n "${OPTARG}" ; then
+			pat="${pat}$( printf '\\|^[^\t]\\+\t[^\t]\\+\t[^\t]*[%s]' "${OPTARG}" )"
+		fi
+		rulesfilter="${rulesfilter} | grep '${pat}'"
+		;;
 	h|\?)
 		if test "${opt}" = h ; then
 			usage
@@ -75,19 +95,27 @@ while getopts s:m:M:S:iru:f:h opt ; do
 	esac
 done
 
-if test -z "${rulesfiles}" ; then
-	echo 'found no rules file' >&2
-	exit 1
-fi
+# unitex selects rules and generates style files and sed scripts itself, a
+# filtered rules file is only needed without it.
+if command -v unitex >/dev/null ; then
+	native=true
+else
+	native=false
+
+	if test -z "${rulesfiles}" ; then
+		echo 'found no rules file' >&2
+		exit 1
+	fi
 
-tmprulesfile="/tmp/unitex.$$.tmprulesfile"
-trap 'rm -f "${tmprulesfile}"' EXIT
+	tmprulesfile="/tmp/unitex.$$.tmprulesfile"
+	trap 'rm -f "${tmprulesfile}"' EXIT
 
-eval "grep -v '^#' ${rulesfiles} ${rulesfilter}" | cut -f 1,2 >"${tmprulesfile}"
+	eval "grep -v '^#' ${rulesfiles} ${rulesfilter}" | cut -f 1,2 >"${tmprulesfile}"
 
-if ! test -s "${tmprulesfile}" ; then
-	echo 'no rule matched' >&2
-	exit 1
+	if ! test -s "${tmprulesfile}" ; then
+		echo 'no rule matched' >&2
+		exit 1
+	fi
 fi
 
 shift $(( OPTIND - 1 ))
@@ -193,19 +221,25 @@ EOF
 	rm -f "${gensed_tmpfile1}" "${gensed_tmpfile2}"
 }
 
-if test "${styfile}" ; then
-	if test "${styfile}" = '-' ; then
-		gensty
-	else
-		gensty >"${styfile}"
+if ${native} ; then
+	if test "${styfile}${sedscript}" ; then
+		eval "unitex $(if ${reverse} ; then echo '-r' ; fi) ${unitexopts} ${genopts}" || exit 1
+	fi
+else
+	if test "${styfile}" ; then
+		if test "${styfile}" = '-' ; then
+			gensty
+		else
+			gensty >"${styfile}"
+		fi
 	fi
-fi
 
-if test "${sedscript}" ; then
-	if test "${sedscript}" = '-' ; then
-		gensed
-	else
-		gensed >"${sedscript}"
+	if test "${sedscript}" ; then
+		if test "${sedscript}" = '-' ; then
+			gensed
+		else
+			gensed >"${sedscript}"
+		fi
 	fi
 fi
 
@@ -214,8 +248,8 @@ if test \( "${styfile}" -o "${sedscript}" \) -a -z "$@" ; then
 fi
 
 filter() {
-	if command -v unitex >/dev/null ; then
-		unitex $(if ${reverse} ; then echo '-r' ; fi) -u "${tmprulesfile}" "$@"
+	if ${native} ; then
+		eval "unitex $(if ${reverse} ; then echo '-r' ; fi) ${unitexopts} \"\$@\""
 	else
 		if test "${sedscript}" ; then
 			sed -f "${sedscript}" "$@"
@@ -73,12 +73,12 @@ xmalloc(size_t size)
 void *
 xcalloc(size_t nmemb, size_t size)
 {
-	size_t blksiz = nmemb * size;
+	void *p;
 
-	if (blksiz / size != nmemb)
-		error(EXIT_FAILURE, ENOMEM, "xcalloc");
+	if (!(p = calloc(nmemb, size)))
+		error(EXIT_FAILURE, errno, "calloc");
 
-	return xmalloc(blksiz);
+	return p;
 }
 
 void *
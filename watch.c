@@ -0,0 +1,439 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "strmap.h"
+#include "util.h"
+#include "vec.h"
+
+#include "misc.h"
+#include "rules.h"
+#include "convert.h"
+#include "metrics.h"
+#include "watch.h"
+
+/* A line of a file: its text, newline included, which keys it in the
+ * lines of the file, its result and the last pass it was found in. */
+typedef struct {
+	char *text;
+	char *out;
+	size_t outlen;
+	unsigned long pass;
+} Line;
+
+/* A file or directory watched, st being what stat() gave for it when it
+ * was last looked at; stale is set if it has changed since it was last
+ * converted or scanned.  A file has the path of its result in dest, its
+ * lines as last converted and the result last written. */
+typedef struct Watched {
+	struct Watched *next;
+	char *path;
+	bool isdir;
+	bool stale;
+	struct stat st;
+	char *dest;
+	Strmap *lines;
+	Charv *out;
+} Watched;
+
+static struct {
+	Watched *head;
+	Watched **tail;
+	Strmap *bypath;
+	const char *outdir;
+	struct stat outst;
+	unsigned long pass;
+	Strv *gone;
+	Charv *text;
+	Charv *out;
+	Charv *result;
+} wt;
+
+static bool
+samestat(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+	       && a->st_size == b->st_size && a->st_mode == b->st_mode
+	       && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+	       && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static char *
+joinpath(const char *dir, const char *name)
+{
+	size_t n = strlen(dir);
+	char *p = xmalloc(n + strlen(name) + 2);
+
+	strcpy(p, dir);
+	if (n && p[n - 1] != '/')
+		p[n++] = '/';
+	strcpy(p + n, name);
+	return p;
+}
+
+/* Whether path is relative and has no .. component, so that its result
+ * under outdir lands inside it. */
+static bool
+isbelow(const char *path)
+{
+	const char *p;
+
+	if (*path == '/')
+		return false;
+	for (p = path; *p; p += strcspn(p, "/")) {
+		p += strspn(p, "/");
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == NUL))
+			return false;
+	}
+	return true;
+}
+
+/* Watch path, unless it is already, as it was last found by stat(). */
+static void
+add(const char *path, const struct stat *st)
+{
+	Watched *w;
+
+	if (sm_get(wt.bypath, path))
+		return;
+	w = xmalloc(sizeof(*w));
+	w->next = NULL;
+	w->path = xmalloc(strlen(path) + 1);
+	strcpy(w->path, path);
+	w->isdir = S_ISDIR(st->st_mode);
+	w->stale = true;
+	w->st = *st;
+	w->dest = (w->isdir? NULL: joinpath(wt.outdir, path));
+	w->lines = (w->isdir? NULL: sm_new());
+	w->out = NULL;
+	sm_insert(wt.bypath, w->path, w);
+	*wt.tail = w;
+	wt.tail = &w->next;
+}
+
+static bool
+istex(const char *name)
+{
+	size_t n = strlen(name);
+
+	return n > 4 && !strcmp(name + n - 4, ".tex");
+}
+
+/* Watch the files named *.tex in directory d and the directories in it,
+ * leaving out hidden ones, those linked to and outdir. */
+static void
+scan(Watched *d)
+{
+	struct dirent *de;
+	struct stat st;
+	char *path;
+	DIR *dir;
+
+	if (!(dir = opendir(d->path))) {
+		error(0, errno, "couldn't open %s", d->path);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		path = joinpath(d->path, de->d_name);
+		if (!lstat(path, &st)) {
+			if (S_ISDIR(st.st_mode)) {
+				if (st.st_dev != wt.outst.st_dev || st.st_ino != wt.outst.st_ino)
+					add(path, &st);
+			} else if (istex(de->d_name) && !stat(path, &st) && S_ISREG(st.st_mode)) {
+				add(path, &st);
+			}
+		}
+		free(path);
+	}
+	closedir(dir);
+}
+
+static bool
+readfile(const char *path, Charv *cv)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return false;
+	cv_resize(cv, 0);
+	for (;;) {
+		cv_reserve(cv, cv_size(cv) + BUFSIZ);
+		n = read(fd, cv_getptr(cv, cv_size(cv)), BUFSIZ);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		cv_resize(cv, cv_size(cv) + n);
+	}
+	close(fd);
+	return n == 0;
+}
+
+/* Make the directories leading to path. */
+static void
+makeparents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = NUL;
+		mkdir(path, 0777);
+		*p = '/';
+	}
+}
+
+/* Replace the result of w with cv, through a file next to it that is
+ * renamed over it, so that it is never seen written in part. */
+static bool
+writeresult(Watched *w, const Charv *cv)
+{
+	const char *slash = strrchr(w->dest, '/');
+	size_t n = (slash? slash + 1 - w->dest: 0), off;
+	char *tmp = xmalloc(n + sizeof(".unitexXXXXXX"));
+	ssize_t k;
+	int fd;
+
+	makeparents(w->dest);
+	memcpy(tmp, w->dest, n);
+	strcpy(tmp + n, ".unitexXXXXXX");
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(tmp);
+		return false;
+	}
+	fchmod(fd, w->st.st_mode & 0777);
+	for (off = 0; off < cv_size(cv); off += k) {
+		k = write(fd, cv_getptr(cv, off), cv_size(cv) - off);
+		if (k == -1 && errno == EINTR)
+			k = 0;
+		else if (k == -1)
+			break;
+	}
+	if (close(fd) || off < cv_size(cv) || rename(tmp, w->dest)) {
+		unlink(tmp);
+		free(tmp);
+		return false;
+	}
+	free(tmp);
+	return true;
+}
+
+static void
+deleteline(const char *key, void *value)
+{
+	Line *ln = value;
+
+	free(ln->text);
+	free(ln->out);
+	free(ln);
+}
+
+/* Gather the lines not found in the pass into gone. */
+static void
+findgone(const char *key, void *value)
+{
+	if (((Line *)value)->pass != wt.pass)
+		sv_push(wt.gone, key);
+}
+
+/* Drop the lines of w not found in the pass. */
+static void
+dropgone(Watched *w)
+{
+	Line *ln;
+	size_t i;
+
+	sv_resize(wt.gone, 0);
+	sm_foreach(w->lines, findgone);
+	for (i = 0; i < sv_size(wt.gone); ++i) {
+		ln = sm_get(w->lines, sv_get(wt.gone, i));
+		sm_set(w->lines, ln->text, NULL);
+		deleteline(NULL, ln);
+	}
+}
+
+/* Convert file w, each line of it found among its lines from before
+ * taken from there, and write the result unless it is unchanged. */
+static void
+convertfile(Converter *cvt, Watched *w)
+{
+	char *text, *nl, c;
+	size_t len, off, n;
+	struct stat st;
+	bool keep, inplace;
+	FILE *f = NULL;
+	Line *ln;
+	Charv *cv;
+
+	if (!readfile(w->path, wt.text)) {
+		error(0, errno, "couldn't read %s", w->path);
+		return;
+	}
+	mt_start();
+	++wt.pass;
+	len = cv_size(wt.text);
+	/* Each line is made a string in place to look it up. */
+	cv_push(wt.text, NUL);
+	text = cv_getptr(wt.text, 0);
+	if (len && !(f = fmemopen(text, len, "r")))
+		error(EXIT_FAILURE, errno, "fmemopen");
+	cv_resize(wt.result, 0);
+	for (off = 0; off < len; off += n) {
+		nl = memchr(text + off, '\n', len - off);
+		n = (nl? nl + 1 - text - off: len - off);
+
+		/* Lines with a NUL in them aren't kept. */
+		ln = NULL;
+		if ((keep = !memchr(text + off, NUL, n))) {
+			c = text[off + n];
+			text[off + n] = NUL;
+			ln = sm_get(w->lines, text + off);
+			text[off + n] = c;
+		}
+		if (ln) {
+			ln->pass = wt.pass;
+			cv_resize(wt.result, cv_size(wt.result) + ln->outlen);
+			memcpy(cv_getptr(wt.result, cv_size(wt.result) - ln->outlen), ln->out, ln->outlen);
+			continue;
+		}
+
+		if (fseek(f, off, SEEK_SET))
+			error(EXIT_FAILURE, errno, "fseek");
+		convertline(cvt, f, wt.out);
+		if (ferror(f))
+			error(EXIT_FAILURE, 0, "input error during reading %s", w->path);
+		if (keep) {
+			ln = xmalloc(sizeof(*ln));
+			ln->text = xmalloc(n + 1);
+			memcpy(ln->text, text + off, n);
+			ln->text[n] = NUL;
+			ln->outlen = cv_size(wt.out);
+			ln->out = xmalloc(ln->outlen + 1);
+			memcpy(ln->out, cv_getptr(wt.out, 0), ln->outlen);
+			ln->pass = wt.pass;
+			sm_insert(w->lines, ln->text, ln);
+		}
+		cv_resize(wt.result, cv_size(wt.result) + cv_size(wt.out));
+		memcpy(cv_getptr(wt.result, cv_size(wt.result) - cv_size(wt.out)),
+		       cv_getptr(wt.out, 0), cv_size(wt.out));
+		cv_resize(wt.out, 0);
+	}
+	if (f)
+		fclose(f);
+	cv_pop(wt.text);
+	dropgone(w);
+
+	/* Converting in place, a file is its own last result. */
+	inplace = !stat(w->dest, &st) && st.st_dev == w->st.st_dev && st.st_ino == w->st.st_ino;
+	cv = (inplace? wt.text: w->out);
+	if (!cv || cv_size(cv) != cv_size(wt.result)
+	    || (cv_size(cv) && memcmp(cv_getptr(cv, 0), cv_getptr(wt.result, 0), cv_size(cv)))) {
+		if (!writeresult(w, wt.result)) {
+			error(0, errno, "couldn't write %s", w->dest);
+		} else {
+			if (inplace && !stat(w->path, &st))
+				w->st = st;
+			if (printf("%s\n", w->dest) < 0 || fflush(stdout) == EOF)
+				error(EXIT_FAILURE, errno, "output error");
+		}
+	}
+	mt_stop(cvt->reverse, len, 0);
+	cv = w->out;
+	w->out = wt.result;
+	wt.result = (cv? cv: cv_new());
+}
+
+/* Forget the lines of every file, as the rules have changed, and have
+ * them all converted. */
+static void
+forget(void)
+{
+	Watched *w;
+
+	for (w = wt.head; w; w = w->next) {
+		if (w->isdir)
+			continue;
+		sm_foreach(w->lines, deleteline);
+		sm_delete(w->lines);
+		w->lines = sm_new();
+		w->stale = true;
+	}
+}
+
+void
+watchfiles(Converter *cvt, const Strv *paths, const char *outdir,
+           unsigned long interval, bool (*checkpoint)(void))
+{
+	struct timespec ts;
+	struct stat st;
+	Watched *w;
+	size_t i;
+
+	wt.head = NULL;
+	wt.tail = &wt.head;
+	wt.bypath = sm_new();
+	wt.outdir = outdir;
+	wt.gone = sv_new();
+	wt.text = cv_new();
+	wt.out = cv_new();
+	wt.result = cv_new();
+
+	for (i = 0; i < sv_size(paths); ++i)
+		if (!isbelow(sv_get(paths, i)))
+			error(EXIT_FAILURE, 0, "%s: not a relative path without ..", sv_get(paths, i));
+	if (mkdir(outdir, 0777) && errno != EEXIST)
+		error(EXIT_FAILURE, errno, "couldn't make %s", outdir);
+	if (stat(outdir, &wt.outst))
+		error(EXIT_FAILURE, errno, "couldn't open %s", outdir);
+	for (i = 0; i < sv_size(paths); ++i) {
+		if (stat(sv_get(paths, i), &st))
+			error(EXIT_FAILURE, errno, "couldn't open %s", sv_get(paths, i));
+		add(sv_get(paths, i), &st);
+	}
+
+	ts.tv_sec = interval / 1000;
+	ts.tv_nsec = interval % 1000 * 1000000;
+	for (;;) {
+		if (checkpoint && checkpoint())
+			forget();
+		/* Files and directories found by a scan are appended, and
+		 * looked at in the same pass. */
+		for (w = wt.head; w; w = w->next) {
+			/* A file missing may be being replaced. */
+			if (stat(w->path, &st))
+				continue;
+			if (!samestat(&st, &w->st)) {
+				w->st = st;
+				w->stale = true;
+				if (!w->isdir)
+					continue;
+			} else if (!w->stale) {
+				continue;
+			}
+			if (w->isdir)
+				scan(w);
+			else
+				convertfile(cvt, w);
+			w->stale = false;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
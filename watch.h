@@ -0,0 +1,21 @@
+/*  unitex: TeX-to-Unicode converter.
+ *  Copyright (C) 2022 Juiyung Hsu
+ *  License: GNU General Public License v3.0
+ *  You should have received a copy of the license along with this
+ *  file. If not, see <http://www.gnu.org/licenses>.
+ */
+
+/* <stdbool.h> <stdint.h> <stdio.h> "strmap.h" "vec.h" "rules.h" "convert.h" should be included before this header */
+
+/* Convert with cvt each of paths, or for a directory each file named
+ * *.tex under it, into the same path under outdir, and keep doing so for
+ * each file that changes, looking every interval milliseconds.  A file
+ * is converted once it has looked the same twice in a row, so a burst of
+ * saves is converted once, and only its lines not seen in it before are
+ * converted.  The path of each result written is printed on a line.
+ * checkpoint, unless NULL, is called before each look, where *cvt->rules
+ * may be replaced, which it returns true for.  Exits if any of paths is
+ * absolute or goes up with .., as its result would land outside outdir.
+ * Never returns. */
+void watchfiles(Converter *cvt, const Strv *paths, const char *outdir,
+                unsigned long interval, bool (*checkpoint)(void));